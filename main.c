@@ -25,20 +25,170 @@
  */
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
+#include <libavutil/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <png.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 
 
+// size of the buffer handed to the custom AVIOContext used for stdin and read callbacks.
+// ffmpeg's own file protocol reads in 32k chunks; going a bit bigger means fewer trips
+// through the read callback for pipes without holding up the first decoded frame.
+#define AVIO_BUFFER_SIZE 65536
+
+// how much of the input ffmpeg may read (in bytes), and how much media time it may look at
+// (in microseconds), while guessing stream parameters in fast start mode (-f). ffmpeg's
+// defaults are 5 MB and 5 seconds, which for video files means reading a lot of video we
+// will never use.
+#define FAST_PROBE_SIZE "65536"
+#define FAST_ANALYZE_DURATION "500000"
+
+// crossover frequencies (in Hz) splitting the audio into low, mid and high bands for -B.
+// Roughly where kick drums stop and where hi-hats and cymbals start.
+#define BAND_LOW_CROSSOVER 200.0
+#define BAND_HIGH_CROSSOVER 2000.0
+
+// how many seconds of audio the band filters are run over before a block of columns that's
+// scanned on its own thread, so they have settled by the time the block starts. The low
+// filter settles in about a millisecond.
+#define BAND_WARM_UP_TIME 0.02
+
+// how many samples each column of the fine grained waveform summary kept for each file of a
+// playlist (multiple -i), or in the cache (-K), covers. The summaries are shrunk down to the
+// real column count once it's known. At 44.1 kHz this is a column every 6 ms.
+#define FINE_SUMMARY_BIN_SIZE 256
+
+// how big the cache (-K) may get, in megabytes, if no size is given
+#define DEFAULT_CACHE_SIZE 1024
+
+// first bytes of every cache file. Bump the number whenever the layout of the file (or of
+// what goes into its key) changes, so old entries are never read back.
+#define CACHE_MAGIC "WFC2"
+
+// nanoseconds of a file's modification time, so the cache (-K) can tell apart versions of a
+// file written within the same second
+#ifdef __APPLE__
+#define MTIME_NSEC(file_stat) ((file_stat).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(file_stat) ((file_stat).st_mtim.tv_nsec)
+#endif
+
+// how many columns of the image each thread draws at a time when work is split across
+// threads. 16 columns of 4 byte pixels is a 64 byte cache line, so two threads never write
+// to the same line of a row.
+#define BLOCK_COLUMNS 16
+
+// most the auto gain (-g) will boost a waveform by, so silence doesn't get blown up into a
+// full height wall of noise. 100 is 40 dB.
+#define AUTO_GAIN_MAX 100.0
+
+// dynamic range of the log scaled waveform (-l) in dB. Anything this far below full scale is
+// drawn on the center line.
+#define LOG_SCALE_DB_RANGE 48.0
+
+// dynamic range of the spectrogram (-S) in dB. Anything this far below full scale is drawn
+// in the darkest color.
+#define SPECTROGRAM_DB_RANGE 100.0
+
+// how many samples in a row have to be at full scale before they count as clipped (-r). A
+// single sample at full scale is just a loud peak that happens to fit.
+#define CLIP_MIN_SAMPLES 3
+
+// lowest frequency (in Hz) shown on the spectrogram's log frequency axis
+#define SPECTROGRAM_MIN_FREQUENCY 20.0
+
+// how often (in microseconds) the progress of decoding is reported on the -p file descriptor
+#define PROGRESS_INTERVAL 500000
+
+// how much memory to reserve for samples up front when the container can't tell us how long
+// the audio is (streams from stdin, mostly)
+#define DEFAULT_SAMPLE_BUFFER_SIZE (1024 * 1024)
+
+
+
 png_byte color_waveform[4] = {89, 89, 89, 255};
 png_byte color_bg[4] = {255, 255, 255, 255};
 
+// colors of the low, mid and high frequency bands when coloring the waveform by its
+// spectral content (-B). The alpha of the waveform color is used for all of them.
+png_byte color_low[3] = {235, 50, 35};
+png_byte color_mid[3] = {80, 215, 60};
+png_byte color_high[3] = {40, 130, 255};
+
 char version[] = "Waveform 0.9.1";
 
+// read every audio track in the input instead of just the best one (-a)
+int read_all_tracks = 0;
+
+// spend as little time as possible probing the input before decoding (-f)
+int fast_start = 0;
+
+// color each column of the waveform by the energy in its low, mid and high bands (-B)
+int band_colors = 0;
+
+// scale the waveform so this percentile of its column peaks reaches full height (-g). 100
+// is the loudest peak. 0 means no auto gain.
+double auto_gain = 0.0;
+
+// scale the waveform in dB instead of linearly (-l)
+int log_scale = 0;
+
+// draw a spectrogram instead of a waveform, with this many samples per FFT (-S). 0 means
+// draw a waveform.
+int spectrogram_size = 0;
+
+// how many samples apart the spectrogram's FFTs are (-S SIZE:HOP). 0 means one FFT per
+// column of the image.
+int spectrogram_hop = 0;
+
+// how many threads to split work up between (-j). 0 means one per CPU.
+int thread_count = 0;
+
+// which channels of the input to keep, or how to mix them down, as given to -C. NULL means
+// keep every channel as it is.
+const char *channel_mix_spec = NULL;
+
+// directory fine grained summaries of decoded files are cached in (-K), or NULL to not cache
+// anything, and how many bytes the cached files may take up before the least recently used
+// ones get thrown out
+const char *cache_dir = NULL;
+int64_t cache_size_limit = (int64_t) DEFAULT_CACHE_SIZE * 1024 * 1024;
+
+// how quiet (as a fraction of full scale) audio has to be to count as silent, and how long
+// (in seconds) it has to stay that quiet, when looking for silence (-s). -60 dB by default.
+double silence_level = 0.001;
+double silence_duration = 0.5;
+
+// file the silent and clipped spans of the audio are written to as JSON (-r), or NULL if
+// they aren't being looked for
+FILE *span_report = NULL;
+
+// how many tracks have been written to the span report so far
+int span_report_count = 0;
+
+// file descriptor progress is reported on as lines of JSON (-p). -1 means don't report.
+int progress_fd = -1;
+
+// when the program started, so progress reports can say how long things have been going
+int64_t progress_start_time = 0;
+
+// set by a signal (SIGINT, SIGTERM, or SIGALRM when the -T deadline is up) to ask every
+// stage of the program to stop what it's doing, clean up and exit
+volatile sig_atomic_t cancelled = 0;
+
 // struct for creating PNG images.
 typedef struct WaveformPNG {
     int width;
@@ -50,6 +200,79 @@ typedef struct WaveformPNG {
     png_bytep *pRows; // pointer to all the rows of pixels in the image
 } WaveformPNG;
 
+// state for splitting a channel into low, mid and high frequency bands while scanning its
+// samples (-B). Two one-pole low pass filters make the crossover: everything below the
+// first is low, everything above the second is high, and what's between them is mid.
+// It's far from a steep crossover, but it's cheap enough to run on every sample alongside
+// the min/max scan and plenty to tell a kick from a hi-hat.
+typedef struct BandSplitter {
+    double low_coefficient; // smoothing factor of the low crossover filter
+    double high_coefficient; // smoothing factor of the high crossover filter
+    double low_state; // last output of the low crossover filter
+    double high_state; // last output of the high crossover filter
+    double energy[3]; // sum of squares of the low, mid and high band since the last column
+} BandSplitter;
+
+// stretches of samples of a single channel, in samples from the start of the audio
+typedef struct SpanList {
+    int *start; // first sample of each span
+    int *end; // one past the last sample of each span
+    int count;
+    int allocated; // how many spans there's room for
+} SpanList;
+
+// state for finding the silent and clipped spans of a channel while scanning its samples (-r)
+typedef struct SpanDetector {
+    int min_silence; // fewest samples a silent span can have
+    double silence_level; // loudest normalized level that still counts as silent
+    int first_sample; // first sample the detector was fed
+    int silence_start; // first sample of the quiet run we're in, or -1 if we aren't in one
+    int clip_start; // first sample of the full scale run we're in, or -1 if we aren't in one
+
+    // where the quiet and full scale runs going on at `first_sample` ended, or -1 while they
+    // are still going. When a block of columns is scanned on its own, these runs may have
+    // started in the block before it, so they're left for `merge_spans` to sort out.
+    int silence_lead_end;
+    int clip_lead_end;
+
+    SpanList silence;
+    SpanList clipping;
+} SpanDetector;
+
+// a piece of work that can be split up into blocks run on different threads. Gets called once
+// with every block index from 0 up to the number of blocks.
+typedef void (*ParallelTask)(void *context, int block);
+
+// state shared by the threads running a ParallelTask
+typedef struct ParallelJob {
+    ParallelTask task;
+    void *context;
+    int block_count;
+    int next_block; // next block that hasn't been picked up by a thread yet
+    pthread_mutex_t lock; // guards `next_block`
+} ParallelJob;
+
+// per-column reduction of the audio that waveforms are drawn from. Sample values are
+// normalized to -1.0 to 1.0, so it doesn't matter what format the audio was in.
+typedef struct WaveformSummary {
+    int columns; // how many columns of pixels the audio was reduced to
+    int channels; // how many waveforms there are (channels, or 1 if they were averaged)
+
+    // lowest and highest sample of each column. All columns of the first channel, followed by
+    // all columns of the second channel, etc. An empty column has a min above its max.
+    double *min;
+    double *max;
+
+    // energy of the low, mid and high bands of each column (three floats per column, laid out
+    // like `min`), or NULL if the waveform isn't colored by band (-B)
+    float *energy;
+
+    // silent and clipped spans of each channel of the audio (even when the channels were
+    // averaged into one waveform), or NULL if they weren't looked for (-r)
+    SpanDetector *spans;
+    int span_channels;
+} WaveformSummary;
+
 // normalized version of the AVSampleFormat enum that doesn't care about planar vs interleaved
 enum SampleFormat {
     SAMPLE_FORMAT_UINT8,
@@ -59,6 +282,38 @@ enum SampleFormat {
     SAMPLE_FORMAT_DOUBLE
 };
 
+// which channels of a track are kept, or how they are mixed together, while reading its
+// samples (-C). Channels that aren't used are never copied out of the decoded frames.
+typedef struct ChannelMix {
+    int inputs; // how many channels the decoder gives us
+    int outputs; // how many channels end up in the `samples` buffer
+
+    // for a plain selection of channels, which input channel each output channel is. The
+    // samples are copied as they are, in the format they were decoded in. NULL when mixing.
+    int *source;
+
+    // how much of each input channel goes into each output channel (all the inputs of the
+    // first output, then all the inputs of the second, etc.) when mixing. Mixed samples are
+    // stored as floats.
+    float *weights;
+
+    // format the decoder gives us samples in, and the range of values they can have
+    enum SampleFormat input_format;
+    int input_sample_size;
+    int input_min;
+    int input_max;
+} ChannelMix;
+
+// how much work it took to get at the audio of a file
+typedef struct AudioStats {
+    double open_time; // seconds spent opening the input and figuring out its streams
+    double read_time; // seconds spent demuxing and decoding
+    int64_t probe_bytes; // bytes read from the input while opening it
+    int64_t bytes_read; // bytes read from the input in total
+    int64_t input_size; // size of the input in bytes, or <= 0 if it isn't known
+    int probed; // was avformat_find_stream_info needed to figure out the streams?
+} AudioStats;
+
 // struct to store the raw important data of an audio file pulled from ffmpeg
 typedef struct AudioData {
     /*
@@ -82,6 +337,12 @@ typedef struct AudioData {
      */
     int size;
 
+    /*
+     * How many bytes have been allocated for the `samples` buffer so far. Only meaningful
+     * while `read_audio_data` is filling it up.
+     */
+    int allocated_size;
+
     /*
      * Length of audio file in seconds. Not known until after a call to `read_audio_data` or
      * `read_audio_metadata`
@@ -122,8 +383,171 @@ typedef struct AudioData {
      * audio data.
      */
     AVCodecContext *decoder_context;
+
+    /*
+     * Index of the stream in `format_context` this struct holds the audio of
+     */
+    int stream_index;
+
+    /*
+     * The next audio track of the same file when more than one track is being read (-a).
+     * All tracks in the chain share `format_context` and are filled in by the same pass
+     * over the file. The first struct in the chain owns the format context, and freeing it
+     * frees every track after it. NULL if this is the last (or only) track.
+     */
+    struct AudioData *next;
+
+    /*
+     * Custom I/O context used when the audio isn't read from a file path (stdin, read
+     * callbacks). NULL if ffmpeg opened the input itself.
+     */
+    AVIOContext *io_context;
+
+    /*
+     * Channels kept (or mixed) while reading the samples (-C), or NULL if every channel is
+     * kept. If there is one, `channels`, `format` and `sample_size` describe what ends up in
+     * the `samples` buffer, not what the decoder gives us.
+     */
+    ChannelMix *mix;
+
+    /*
+     * Fine grained summary of the track (see FINE_SUMMARY_BIN_SIZE) when it was read from, or
+     * is about to be written to, the cache (-K). Otherwise NULL. A track read from the cache
+     * has nothing else but its metadata: no samples, format context or decoder.
+     */
+    WaveformSummary *summary;
+
+    /*
+     * Which of the input files (-i) this is, counting from 0. Only used to tell the inputs of
+     * a playlist apart in progress reports.
+     */
+    int input_index;
+
+    /*
+     * Time and I/O spent on the input. Opening stats are known after the input is opened,
+     * the rest after a call to `read_audio_data` or `read_audio_metadata`. Only kept on the
+     * first track of a chain, since all tracks are read together.
+     */
+    AudioStats stats;
 } AudioData;
 
+// signature of the function used to pull bytes out of a stream with `open_audio_stream`.
+// Same contract as an AVIOContext read_packet callback: fill up to `buf_size` bytes of `buf`
+// and return how many were written, or 0/AVERROR_EOF once there is nothing left.
+typedef int (*AudioReadCallback)(void *opaque, uint8_t *buf, int buf_size);
+
+// precomputed tables for a real-input FFT of a fixed size, shared read-only by every thread
+// drawing the spectrogram. Everything is kept as separate arrays of floats (rather than
+// arrays of complex numbers) so the compiler can vectorize the butterfly loops.
+typedef struct FFT {
+    int size; // number of real input samples. Always a power of two.
+    int half; // size / 2. The size of the complex FFT that does the actual work
+    int *bit_reverse; // bit reversed index of each of the `half` complex inputs
+    float *twiddle_re; // twiddle factors of each stage of the complex FFT, stage after stage
+    float *twiddle_im;
+    float *split_re; // factors for untangling the real FFT from the complex FFT's output
+    float *split_im;
+    float *window; // Hann window applied to the input
+} FFT;
+
+// which FFT bins a row of the spectrogram shows
+typedef struct SpectrogramRow {
+    int band; // which of the stacked spectrograms the row belongs to
+    int first_bin; // the row shows the loudest of the bins from `first_bin` to `last_bin`...
+    int last_bin;
+    float center_bin; // ...or, if there are none (low frequencies), interpolates at this bin
+} SpectrogramRow;
+
+// everything the threads drawing a spectrogram need to know
+typedef struct Spectrogram {
+    WaveformPNG *png;
+    AudioData *data;
+    FFT *fft;
+    SpectrogramRow *rows; // one for each row of the image
+    png_byte (*colors)[4]; // 256 entry color lookup table, from quietest to loudest
+    int bands; // how many spectrograms are stacked in the image (channels, or 1 if monofied)
+    int sample_count; // samples per channel
+    int hop; // samples between FFTs, or 0 for one FFT per column
+} Spectrogram;
+
+// everything the threads drawing a waveform need to know
+typedef struct WaveformDrawing {
+    WaveformPNG *png;
+    WaveformSummary *summary;
+    double gain; // how much to scale the waveform by (-g)
+    int padding; // empty rows above each waveform
+    int *start_y; // first row of each channel's part of the image (including its top padding)
+    int *end_y; // last row of each channel's part of the image
+    int *heights; // height of each channel's waveform
+} WaveformDrawing;
+
+// everything the threads reducing audio to a WaveformSummary need to know
+typedef struct SummaryJob {
+    AudioData *data;
+    WaveformSummary *summary;
+    SpanDetector *spans; // span detectors of each channel of each block, block after block (-r)
+    int block_count; // how many blocks of BLOCK_COLUMNS columns the summary is split into
+    int sample_min; // range of values a sample can have in the audio's format
+    int sample_max;
+    int samples_per_pixel; // samples (of all channels) in each column
+} SummaryJob;
+
+// one input file of a playlist (multiple -i)
+typedef struct PlaylistEntry {
+    const char *pFilePath; // path of the file, or - for stdin
+    AudioData *data; // the opened file, or NULL if it couldn't be read
+    WaveformSummary *summary; // fine grained summary of the file's waveform
+} PlaylistEntry;
+
+// everything the threads reading a playlist need to know
+typedef struct Playlist {
+    PlaylistEntry *entries;
+    int count;
+    int metadata; // only read metadata (-d)
+    int monofy; // combine the channels of each file into one waveform (-m)
+} Playlist;
+
+
+
+// libpng write callback. Writes to the output file just like png_init_io would, except that
+// a write interrupted by a signal (see `cancel_program`, which is installed without
+// SA_RESTART) carries on where it left off instead of failing the image.
+static void write_png_data(png_structp png, png_bytep data, png_size_t length) {
+    FILE *pFile = (FILE *) png_get_io_ptr(png);
+
+    while (length > 0) {
+        errno = 0;
+
+        size_t written = fwrite(data, 1, length, pFile);
+
+        data += written;
+        length -= written;
+
+        if (length > 0) {
+            if (errno != EINTR) {
+                png_error(png, "Write Error");
+            }
+
+            clearerr(pFile);
+        }
+    }
+}
+
+
+
+// libpng flush callback to go with `write_png_data`
+static void flush_png_data(png_structp png) {
+    FILE *pFile = (FILE *) png_get_io_ptr(png);
+
+    for (errno = 0; fflush(pFile) != 0; errno = 0) {
+        if (errno != EINTR) {
+            png_error(png, "Write Error");
+        }
+
+        clearerr(pFile);
+    }
+}
+
 
 
 // initialize all the structs necessary to start writing png images with libpng
@@ -145,7 +569,7 @@ WaveformPNG init_png(const char *pOutFile, int width, int height) {
     ret.png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     ret.png_info = png_create_info_struct(ret.png);
 
-    png_init_io(ret.png, ret.pPNGFile);
+    png_set_write_fn(ret.png, ret.pPNGFile, write_png_data, flush_png_data);
 
     png_set_IHDR(
         ret.png,
@@ -159,13 +583,20 @@ WaveformPNG init_png(const char *pOutFile, int width, int height) {
         PNG_FILTER_TYPE_DEFAULT
     );
 
-    //allocate memory for each row of pixels we will be drawing to
+    //allocate memory for each row of pixels we will be drawing to. Every row starts on a cache
+    //line, so the blocks of BLOCK_COLUMNS columns drawn by different threads line up with
+    //cache lines of every row.
     ret.pRows = malloc(sizeof(png_bytep) * ret.height);
 
     int y = 0;
     for (; y < ret.height; ++y) {
-        png_bytep row = malloc(sizeof(png_bytep) * ret.width);
-        ret.pRows[y] = row;
+        void *row = NULL;
+
+        if (posix_memalign(&row, BLOCK_COLUMNS * 4, sizeof(png_byte) * 4 * ret.width) != 0) {
+            row = NULL;
+        }
+
+        ret.pRows[y] = (png_bytep) row;
     }
 
     return ret;
@@ -193,30 +624,50 @@ void write_png(WaveformPNG *pWaveformPNG) {
 
 // close and free ffmpeg structs
 void cleanup(AVFormatContext *pFormatContext, AVCodecContext *pDecoderContext) {
-    avformat_close_input(&pFormatContext);
+    // the decoder context belongs to one of the format context's streams, so close it first
     avcodec_close(pDecoderContext);
+    avformat_close_input(&pFormatContext);
 }
 
 
 
-// close and destroy all the png structs we were using to draw png images
-void close_png(WaveformPNG *pWaveformPNG) {
-    //TODO: free pRows and WaveformPNG struct
-    png_destroy_write_struct(&(pWaveformPNG->png), &(pWaveformPNG->png_info));
-    fclose(pWaveformPNG->pPNGFile);
+// free a custom AVIOContext along with its buffer. ffmpeg won't do this for us when closing
+// the format context, since it didn't create it.
+static void free_io_context(AVIOContext *pIOContext) {
+    if (pIOContext) {
+        // ffmpeg may have swapped the buffer out from under us, so free whatever it has now
+        av_free(pIOContext->buffer);
+        av_free(pIOContext);
+    }
 }
 
 
 
-// free memory allocated by an AudioData struct
-void free_audio_data(AudioData *data) {
-    cleanup(data->format_context, data->decoder_context);
+// free a ChannelMix made by `create_channel_mix`
+static void free_channel_mix(ChannelMix *mix) {
+    if (mix == NULL) {
+        return;
+    }
 
-    if (data->samples != NULL) {
-        free(data->samples);
+    free(mix->source);
+    free(mix->weights);
+    free(mix);
+}
+
+
+
+// close and destroy all the png structs we were using to draw png images
+void close_png(WaveformPNG *pWaveformPNG) {
+    int y = 0;
+    for (; y < pWaveformPNG->height; ++y) {
+        free(pWaveformPNG->pRows[y]);
     }
 
-    free(data);
+    free(pWaveformPNG->pRows);
+    pWaveformPNG->pRows = NULL;
+
+    png_destroy_write_struct(&(pWaveformPNG->png), &(pWaveformPNG->png_info));
+    fclose(pWaveformPNG->pPNGFile);
 }
 
 
@@ -297,208 +748,1645 @@ void get_format_range(enum SampleFormat format, int *min, int *max) {
 
 
 
-// draw a column segment in the output image. It will draw in the x coordinate given by
-// column_index, draw the background color between start_y and end_y coordinates,
-// and draw the waveform color between waveform_top and waveform_bottom coordinates.
-void draw_column_segment(WaveformPNG *png,
-                         int column_index,
-                         int start_y,
-                         int end_y,
-                         int waveform_top,
-                         int waveform_bottom
-) {
-    int y = end_y;
+// set on threads while they are running a block of a ParallelTask, so a task that calls
+// `run_parallel` itself (reducing the files of a playlist) doesn't start threads of its own
+static __thread int running_parallel_task = 0;
 
-    // draw the bottom background
-    for (; y > waveform_bottom; --y) {
-        memcpy(png->pRows[y] + column_index * 4, color_bg, 4);
-    }
 
-    // draw the waveform from the bottom to top
-    for (; y >= waveform_top; --y) {
-        memcpy(png->pRows[y] + column_index * 4, color_waveform, 4);
-    }
 
-    // draw the top background
-    for (; y >= start_y; --y) {
-        memcpy(png->pRows[y] + column_index * 4, color_bg, 4);
+// how many threads `run_parallel` should use
+static int get_thread_count() {
+    long cpus;
+
+    if (thread_count > 0) {
+        return thread_count;
     }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 0 ? (int) cpus : 1;
 }
 
 
 
-// take the given WaveformPNG struct and draw an audio waveform based on the data from
-// the given AudioData struct. 
-void draw_waveform(WaveformPNG *png, AudioData *data) {
-    // figure out the min and max ranges of samples, based on bit depth and format
-    int sample_min;
-    int sample_max;
+// thread entry point for `run_parallel`. Keeps picking up blocks until there are none left.
+static void *run_parallel_worker(void *arg) {
+    ParallelJob *job = (ParallelJob *) arg;
+    int was_running_parallel_task = running_parallel_task;
 
-    get_format_range(data->format, &sample_min, &sample_max);
+    running_parallel_task = 1;
 
-    uint32_t sample_range = sample_max - sample_min; // total range of values a sample can have
-    int sample_count = data->size / data->sample_size / data->channels; // samples per channel
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int block = job->next_block++;
+        pthread_mutex_unlock(&job->lock);
 
-    // how many samples fit in a column of pixels? (include channels. the loop skips over channels
-    // it doesn't yet care about, but we still need to know about all of them.
-    int samples_per_pixel = (sample_count / png->width) * data->channels;
+        // once cancelled, leave the blocks nobody has started on alone
+        if (block >= job->block_count || cancelled) {
+            break;
+        }
 
-    // make it so that the total amount of padding is 10% of the height of the image
-    int padding = (int) (png->height * 0.1 / data->channels);
+        job->task(job->context, block);
+    }
 
-    // how tall should each channel be. Because the height is variable, it is quite possible
-    // that each channel height will not be uniform. Figure out how big each channel would
-    // be in a perfect world, and then figure out how wrong our guess is so we can correct for
-    // it later.
-    double ch = (png->height - (padding * (data->channels + 1))) / (double) data->channels;
-    double lost_height = ch - floor(ch);
-    int base_channel_height = floor(ch);
+    running_parallel_task = was_running_parallel_task;
 
-    // as we iterate, we'll see which channel needs additional height to account for floating
-    // point/rounding errors. whenever total_lost_height becomes > 1, it means we need to
-    // add an additional pixel (or possibly more) to this channel height.
-    double total_lost_height = 0.0;
+    return NULL;
+}
 
-    int start_y = 0; //where should we start drawing this channel (include TOP padding only)
-    int end_y = 0; //where should we stop drawing this channel (include TOP padding only)
 
-    // for each channel in the input file
-    int c;
-    for (c = 0; c < data->channels; ++c) {
-        int channel_height = base_channel_height;
 
-        // does this channel need to be boosted in height because of rounding errors?
-        total_lost_height += lost_height;
+// run the given task for every block from 0 to block_count, spread across threads (-j).
+// Blocks are handed out in order to whichever thread is free, so tasks must not care which
+// thread runs them or in what order. Returns once every block is done.
+static void run_parallel(ParallelTask task, void *context, int block_count) {
+    // the threads are already busy if this is part of a bigger ParallelTask
+    int threads = running_parallel_task ? 1 : get_thread_count();
+    pthread_t *pThreads = NULL;
+    ParallelJob job;
+    int started = 0;
+    int i;
 
-        if (total_lost_height > 1) {
-            // yes.
-            channel_height += total_lost_height - floor(total_lost_height);
-            total_lost_height -= floor(total_lost_height);
+    if (threads > block_count) {
+        threads = block_count;
+    }
+
+    job.task = task;
+    job.context = context;
+    job.block_count = block_count;
+    job.next_block = 0;
+
+    // the worker locks this even when it's the only one
+    pthread_mutex_init(&job.lock, NULL);
+
+    // the calling thread does its share of the work too, so start one less thread than we
+    // want. If a thread can't be started, the ones that did just pick up the slack (with one
+    // thread there's no point in starting any).
+    if (threads > 1 && (pThreads = malloc(sizeof(pthread_t) * (threads - 1)))) {
+        for (i = 0; i < threads - 1; ++i) {
+            if (pthread_create(&pThreads[started], NULL, run_parallel_worker, &job) == 0) {
+                ++started;
+            }
         }
+    }
 
-        // figure out the start and end heights for drawing this channel
-        start_y = end_y;
-        end_y = start_y + channel_height + padding;
+    run_parallel_worker(&job);
 
-        // if this is the last channel being drawn, set the end to be the bottom of the image.
-        // this is sufficient enough to add the padding to the bottom of the image and correct
-        // for any remaining rounding errors
-        if (c == data->channels - 1) {
-            end_y = png->height - 1;
-        }
+    for (i = 0; i < started; ++i) {
+        pthread_join(pThreads[i], NULL);
+    }
 
-        // for each column of pixels in the output image
-        int x;
-        for (x = 0; x < png->width; ++x) {
-            // find the minimum sample value, and the maximum
-            // sample value within the the range of samples that fit within this column of pixels
-            double min = sample_max;
-            double max = sample_min;
+    pthread_mutex_destroy(&job.lock);
+    free(pThreads);
+}
 
-            // find out the min and max sample values in this column of pixels
-            int i;
-            for (i = c; i < samples_per_pixel; i += data->channels) {
-                int index = x * samples_per_pixel + i;
-                double value = get_sample(data, index);
 
-                if (value < min) {
-                    min = value;
-                }
 
-                if (value > max) {
-                    max = value;
-                }
-            }
+// set up a BandSplitter for audio with the given sample rate
+static void init_band_splitter(BandSplitter *splitter, int sample_rate) {
+    memset(splitter, 0, sizeof(BandSplitter));
 
-            // calculate where to draw the waveform in the channel range
-            int waveform_top = (max - sample_min) * channel_height / sample_range;
-            int waveform_bottom = (min - sample_min) * channel_height / sample_range;
+    splitter->low_coefficient = 1.0 - exp(-2.0 * M_PI * BAND_LOW_CROSSOVER / sample_rate);
+    splitter->high_coefficient = 1.0 - exp(-2.0 * M_PI * BAND_HIGH_CROSSOVER / sample_rate);
+}
 
-            // flip it (drawing coordinates go from 0 to h, but audio wants positive samples
-            // on top and negative samples below with 0 in the center of the channel
-            waveform_bottom = channel_height - waveform_bottom;
-            waveform_top = channel_height - waveform_top;
 
-            // offset calculations to account for padding on the top
-            waveform_top += start_y + padding;
-            waveform_bottom += start_y + padding;
-            
-            draw_column_segment(png, x, start_y, end_y, waveform_top, waveform_bottom);
-        }
-    }
+
+// run a sample (normalized to -1.0 to 1.0) through the crossover and add it to the energy
+// of each band
+static inline void split_bands(BandSplitter *splitter, double value) {
+    splitter->low_state += splitter->low_coefficient * (value - splitter->low_state);
+    splitter->high_state += splitter->high_coefficient * (value - splitter->high_state);
+
+    double low = splitter->low_state;
+    double mid = splitter->high_state - splitter->low_state;
+    double high = value - splitter->high_state;
+
+    splitter->energy[0] += low * low;
+    splitter->energy[1] += mid * mid;
+    splitter->energy[2] += high * high;
 }
 
 
 
-// take the given WaveformPNG struct and draw an audio waveform based on the data from
-// the given AudioData struct. This function will combine all channels into a single waveform
-// by averaging them.
-void draw_combined_waveform(WaveformPNG *png, AudioData *data) {
-    int last_y = png->height - 1; // count of pixels in height starting from 0
+// move the energy each band had in the samples split since the last call into `energy` (low,
+// mid, high) and reset it, so the splitter is ready for the next column. The filter state is
+// kept, since the audio carries on into the next column.
+static void store_band_energy(BandSplitter *splitter, float *energy) {
+    int i;
 
-    // figure out the min and max ranges of samples, based on bit depth and format
-    int sample_min;
-    int sample_max;
+    for (i = 0; i < 3; ++i) {
+        energy[i] = (float) splitter->energy[i];
+        splitter->energy[i] = 0.0;
+    }
+}
 
-    get_format_range(data->format, &sample_min, &sample_max); 
 
-    uint32_t sample_range = sample_max - sample_min; // total range of values a sample can have
-    int sample_count = data->size / data->sample_size; // how many samples are there total?
-    int samples_per_pixel = sample_count / png->width; // how many samples fit in a column of pixels?
 
-    // multipliers used to produce averages while iterating through samples.
-    double channel_average_multiplier = 1.0 / data->channels;
+// blend the band colors by how much of the given low, mid and high band energy there is, and
+// put the result into the `color` out parameter
+static void get_band_color(const float *energy, png_byte *color) {
+    // weight each band by its RMS rather than its energy, otherwise the low band (which
+    // almost always has the most energy) drowns everything else out
+    double low = sqrt(energy[0]);
+    double mid = sqrt(energy[1]);
+    double high = sqrt(energy[2]);
+    double total = low + mid + high;
+    int i;
 
-    // 10% padding
-    int padding = (int) (png->height * 0.05);
-    int track_height = png->height - (padding * 2);
+    // nothing but silence. Fall back on the plain waveform color.
+    if (total <= 0.0) {
+        memcpy(color, color_waveform, 4);
+        return;
+    }
 
-    // for each column of pixels in the final output image
-    int x;
-    for (x = 0; x < png->width; ++x) {
-        // find the average sample value, the minimum sample value, and the maximum
-        // sample value within the the range of samples that fit within this column of pixels
-        double min = sample_max;
-        double max = sample_min;
+    for (i = 0; i < 3; ++i) {
+        color[i] = (png_byte) ((color_low[i] * low + color_mid[i] * mid + color_high[i] * high) / total);
+    }
 
-        //for each "sample", which is really a sample for each channel,
-        //reduce the samples * channels value to a single value that is
-        //the average of the samples for each channel.
-        int i;
-        for (i = 0; i < samples_per_pixel; i += data->channels) {
-            double value = 0;
+    color[3] = color_waveform[3];
+}
 
-            int c;
-            for (c = 0; c < data->channels; ++c) {
-                int index = x * samples_per_pixel + i + c;
 
-                value += get_sample(data, index) * channel_average_multiplier;
-            }
 
-            if (value < min) {
-                min = value;
-            }
+// add the span of samples from `start` to `end` to the end of the list
+static void add_span(SpanList *list, int start, int end) {
+    if (list->count == list->allocated) {
+        int allocated = list->allocated ? list->allocated * 2 : 16;
+        int *pStart = realloc(list->start, sizeof(int) * allocated);
 
-            if (value > max) {
-                max = value;
-            }
+        if (pStart == NULL) {
+            return;
         }
 
-        // calculate the y pixel values that represent the waveform for this column of pixels.
-        // they are subtracted from last_y to flip the waveform image, putting positive
-        // numbers above the center of waveform and negative numbers below.
-        int y_max = track_height - ((min - sample_min) * track_height / sample_range) + padding;
-        int y_min = track_height - ((max - sample_min) * track_height / sample_range) + padding;
+        list->start = pStart;
+
+        int *pEnd = realloc(list->end, sizeof(int) * allocated);
+
+        if (pEnd == NULL) {
+            return;
+        }
 
-        draw_column_segment(png, x, 0, last_y, y_min, y_max);
+        list->end = pEnd;
+        list->allocated = allocated;
     }
+
+    list->start[list->count] = start;
+    list->end[list->count] = end;
+    ++list->count;
 }
 
 
 
-// print out help text saying how to use this program and exit
-void help() {
-    printf("%s\n\n", version);
+// make `count` span detectors for channels of the given audio, or return NULL if spans aren't
+// being looked for (-r)
+static SpanDetector *create_span_detectors(AudioData *data, int count) {
+    SpanDetector *detectors;
+    double quantization_offset = 0.0;
+    int sample_min;
+    int sample_max;
+    int i;
+
+    if (span_report == NULL || !(detectors = calloc(count, sizeof(SpanDetector)))) {
+        return NULL;
+    }
+
+    // Integer formats have an even number of sample values, so none of them normalizes to
+    // exactly 0.0: digital silence ends up half a step away from it (128 in unsigned 8 bit
+    // audio normalizes to 1/255, or -48 dB). Count anything within a step of 0.0 as silent,
+    // however low the -s level is.
+    if (data->format != SAMPLE_FORMAT_FLOAT && data->format != SAMPLE_FORMAT_DOUBLE) {
+        get_format_range(data->format, &sample_min, &sample_max);
+        quantization_offset = 2.0 / ((double) sample_max - sample_min);
+    }
+
+    for (i = 0; i < count; ++i) {
+        detectors[i].min_silence = (int) (silence_duration * data->sample_rate);
+        detectors[i].silence_level = silence_level + quantization_offset;
+        detectors[i].silence_start = -1;
+        detectors[i].clip_start = -1;
+    }
+
+    return detectors;
+}
+
+
+
+// get a span detector ready to scan a block of samples starting at `first_sample`, without
+// knowing what came before it
+static void start_span_detector(SpanDetector *detector, int first_sample) {
+    detector->first_sample = first_sample;
+    detector->silence_start = first_sample;
+    detector->clip_start = first_sample;
+    detector->silence_lead_end = -1;
+    detector->clip_lead_end = -1;
+}
+
+
+
+// free the span detectors made by `create_span_detectors`
+static void free_span_detectors(SpanDetector *detectors, int count) {
+    int c;
+
+    if (detectors == NULL) {
+        return;
+    }
+
+    for (c = 0; c < count; ++c) {
+        free(detectors[c].silence.start);
+        free(detectors[c].silence.end);
+        free(detectors[c].clipping.start);
+        free(detectors[c].clipping.end);
+    }
+
+    free(detectors);
+}
+
+
+
+// end the span that started at sample `*pStart` (if there is one) right before sample
+// `index`, keeping it if it's at least `min_length` samples long. If it's the run the
+// detector started in, just remember where it ended in `*pLeadEnd`.
+static void end_span(SpanList *list, int *pStart, int *pLeadEnd, int first_sample, int index,
+                     int min_length
+) {
+    if (*pLeadEnd < 0 && *pStart == first_sample) {
+        *pLeadEnd = index;
+    } else if (*pStart >= 0 && index - *pStart >= min_length) {
+        add_span(list, *pStart, index);
+    }
+
+    *pStart = -1;
+}
+
+
+
+// feed the next sample of a channel, normalized to -1.0 to 1.0, to its span detector. `index`
+// is the sample's position in the channel. Spans are ended as soon as a sample breaks them.
+static inline void detect_spans(SpanDetector *detector, double value, int index) {
+    double level = fabs(value);
+
+    if (level <= detector->silence_level) {
+        if (detector->silence_start < 0) {
+            detector->silence_start = index;
+        }
+    } else if (detector->silence_start >= 0) {
+        end_span(&detector->silence, &detector->silence_start, &detector->silence_lead_end,
+                 detector->first_sample, index, detector->min_silence);
+    }
+
+    if (level >= 1.0) {
+        if (detector->clip_start < 0) {
+            detector->clip_start = index;
+        }
+    } else if (detector->clip_start >= 0) {
+        end_span(&detector->clipping, &detector->clip_start, &detector->clip_lead_end,
+                 detector->first_sample, index, CLIP_MIN_SAMPLES);
+    }
+}
+
+
+
+// end whatever spans are still going once the last sample of a channel has been scanned.
+// `index` is the number of samples in the channel.
+static void finish_spans(SpanDetector *detector, int index) {
+    end_span(&detector->silence, &detector->silence_start, &detector->silence_lead_end,
+             detector->first_sample, index, detector->min_silence);
+    end_span(&detector->clipping, &detector->clip_start, &detector->clip_lead_end,
+             detector->first_sample, index, CLIP_MIN_SAMPLES);
+}
+
+
+
+// Add the spans of one kind found in a block to the spans found in every block before it.
+// `*pStart` is the start of the run still going at the end of the blocks before, or -1,
+// and is updated to the run still going at the end of this block.
+static void merge_span_list(SpanList *list, int *pStart, int min_length, SpanList *block_list,
+                            int first_sample, int lead_end, int block_start
+) {
+    int i;
+
+    if (lead_end < 0) {
+        // the whole block is one run, carrying on the run before it if there is one
+        if (*pStart < 0) {
+            *pStart = first_sample;
+        }
+
+        return;
+    }
+
+    // the run the block started in either carries on the run before it or starts with the
+    // block. Either way, it's now known where it started and ended.
+    int start = *pStart >= 0 ? *pStart : first_sample;
+
+    if (lead_end > start && lead_end - start >= min_length) {
+        add_span(list, start, lead_end);
+    }
+
+    for (i = 0; i < block_list->count; ++i) {
+        add_span(list, block_list->start[i], block_list->end[i]);
+    }
+
+    *pStart = block_start;
+}
+
+
+
+// add what the span detector of a block of samples found to `detector`, which has been fed
+// (or merged with) every sample before the block
+static void merge_spans(SpanDetector *detector, SpanDetector *block) {
+    merge_span_list(&detector->silence, &detector->silence_start, detector->min_silence,
+                    &block->silence, block->first_sample, block->silence_lead_end,
+                    block->silence_start);
+    merge_span_list(&detector->clipping, &detector->clip_start, CLIP_MIN_SAMPLES,
+                    &block->clipping, block->first_sample, block->clip_lead_end,
+                    block->clip_start);
+}
+
+
+
+// The column loops of the summaries skip the last few samples that don't fill up a whole
+// column. Feed those to the span detectors too, starting at sample `first_sample` of each
+// channel, so a span at the very end of the audio isn't cut short, and end every span.
+static void detect_remaining_spans(AudioData *data, SpanDetector *detectors, int first_sample) {
+    int sample_min;
+    int sample_max;
+    int sample_count = data->size / data->sample_size / data->channels;
+    int i;
+    int c;
+
+    get_format_range(data->format, &sample_min, &sample_max);
+
+    double sample_range = (double) sample_max - sample_min;
+
+    for (c = 0; c < data->channels; ++c) {
+        for (i = first_sample; i < sample_count; ++i) {
+            double value = get_sample(data, i * data->channels + c);
+
+            detect_spans(&detectors[c], (value - sample_min) * 2.0 / sample_range - 1.0, i);
+        }
+
+        finish_spans(&detectors[c], sample_count);
+    }
+}
+
+
+
+// draw a column segment in the output image. It will draw in the x coordinate given by
+// column_index, draw the background color between start_y and end_y coordinates,
+// and draw the given waveform color between waveform_top and waveform_bottom coordinates.
+void draw_column_segment(WaveformPNG *png,
+                         int column_index,
+                         int start_y,
+                         int end_y,
+                         int waveform_top,
+                         int waveform_bottom,
+                         png_byte *color
+) {
+    int y = end_y;
+
+    // draw the bottom background
+    for (; y > waveform_bottom; --y) {
+        memcpy(png->pRows[y] + column_index * 4, color_bg, 4);
+    }
+
+    // draw the waveform from the bottom to top
+    for (; y >= waveform_top; --y) {
+        memcpy(png->pRows[y] + column_index * 4, color, 4);
+    }
+
+    // draw the top background
+    for (; y >= start_y; --y) {
+        memcpy(png->pRows[y] + column_index * 4, color_bg, 4);
+    }
+}
+
+
+
+// free a WaveformSummary created by `create_summary`
+void free_summary(WaveformSummary *summary) {
+    if (summary == NULL) {
+        return;
+    }
+
+    free(summary->min);
+    free(summary->max);
+    free(summary->energy);
+    free_span_detectors(summary->spans, summary->span_channels);
+    free(summary);
+}
+
+
+
+// allocate a WaveformSummary for the given number of columns and channels, with every column
+// empty. Band energies are only kept when drawing with -B. Returns NULL if memory couldn't be
+// allocated.
+WaveformSummary *create_summary(int columns, int channels) {
+    WaveformSummary *summary = calloc(1, sizeof(WaveformSummary));
+    int i;
+
+    if (summary == NULL) {
+        return NULL;
+    }
+
+    summary->columns = columns;
+    summary->channels = channels;
+    summary->min = malloc(sizeof(double) * columns * channels);
+    summary->max = malloc(sizeof(double) * columns * channels);
+
+    if (band_colors) {
+        summary->energy = calloc(columns * channels * 3, sizeof(float));
+    }
+
+    if (!summary->min || !summary->max || (band_colors && !summary->energy)) {
+        free_summary(summary);
+        return NULL;
+    }
+
+    // a column with no samples in it has a min above its max, so nothing gets drawn for it
+    for (i = 0; i < columns * channels; ++i) {
+        summary->min[i] = 1.0;
+        summary->max[i] = -1.0;
+    }
+
+    return summary;
+}
+
+
+
+// free memory allocated by an AudioData struct
+void free_audio_data(AudioData *data) {
+    // every track after the first shares the first track's format context, so only close
+    // their decoders
+    AudioData *track = data->next;
+
+    while (track != NULL) {
+        AudioData *next = track->next;
+
+        // tracks read from the cache never had a decoder
+        if (track->decoder_context) {
+            avcodec_close(track->decoder_context);
+        }
+
+        free_channel_mix(track->mix);
+        free_summary(track->summary);
+        free(track->samples);
+        free(track);
+
+        track = next;
+    }
+
+    if (data->format_context) {
+        cleanup(data->format_context, data->decoder_context);
+    }
+
+    free_io_context(data->io_context);
+    free_channel_mix(data->mix);
+    free_summary(data->summary);
+
+    if (data->samples != NULL) {
+        free(data->samples);
+    }
+
+    free(data);
+}
+
+
+
+// check if nothing could be decoded from the given track (and it didn't come from the cache)
+static int is_empty_track(AudioData *track) {
+    return track->size == 0 && track->summary == NULL;
+}
+
+
+
+// Run the band splitter over the samples leading up to `first_sample` (of `channel`, or of
+// every channel averaged together if `channel` is -1) and throw away the energy it found.
+// This puts the filters of a block of columns where they would be if every column before
+// the block had been scanned too, so blocks can be scanned in any order.
+static void warm_up_band_splitter(BandSplitter *splitter, AudioData *data, int channel,
+                                  int first_sample, int sample_min, double sample_range
+) {
+    int warm_up = (int) (BAND_WARM_UP_TIME * data->sample_rate);
+    int i = first_sample > warm_up ? first_sample - warm_up : 0;
+    int c;
+
+    for (; i < first_sample; ++i) {
+        double value = 0;
+
+        if (channel >= 0) {
+            value = get_sample(data, i * data->channels + channel);
+        } else {
+            for (c = 0; c < data->channels; ++c) {
+                value += get_sample(data, i * data->channels + c) * (1.0 / data->channels);
+            }
+        }
+
+        split_bands(splitter, (value - sample_min) * 2.0 / sample_range - 1.0);
+    }
+
+    memset(splitter->energy, 0, sizeof(splitter->energy));
+}
+
+
+
+// set up the job of reducing the given audio to the given summary, with span detectors for
+// every block if spans are being looked for. Returns 0 if memory runs out.
+static int init_summary_job(SummaryJob *job, AudioData *data, WaveformSummary *summary) {
+    int sample_count = data->size / data->sample_size / data->channels; // samples per channel
+
+    job->data = data;
+    job->summary = summary;
+    job->block_count = (summary->columns + BLOCK_COLUMNS - 1) / BLOCK_COLUMNS;
+
+    // figure out the min and max ranges of samples, based on bit depth and format
+    get_format_range(data->format, &job->sample_min, &job->sample_max);
+
+    // how many samples fit in a column of pixels? (include channels, so each column starts on
+    // the first channel. The loops skip over channels they don't yet care about, but we still
+    // need to know about all of them.)
+    job->samples_per_pixel = (sample_count / summary->columns) * data->channels;
+
+    summary->spans = create_span_detectors(data, data->channels);
+    summary->span_channels = data->channels;
+    job->spans = NULL;
+
+    if (summary->spans) {
+        job->spans = create_span_detectors(data, job->block_count * data->channels);
+
+        return job->spans != NULL;
+    }
+
+    return 1;
+}
+
+
+
+// stitch the spans found in each block of a summary job together into the spans of the
+// whole audio, then scan whatever samples the columns didn't cover
+static void finish_summary_job(SummaryJob *job) {
+    AudioData *data = job->data;
+    WaveformSummary *summary = job->summary;
+    int b;
+    int c;
+
+    if (job->spans == NULL) {
+        return;
+    }
+
+    // if there aren't enough samples to go around, the columns are all empty and it's all
+    // left for detect_remaining_spans
+    if (job->samples_per_pixel > 0 && !cancelled) {
+        for (c = 0; c < data->channels; ++c) {
+            for (b = 0; b < job->block_count; ++b) {
+                merge_spans(&summary->spans[c], &job->spans[b * data->channels + c]);
+            }
+        }
+    }
+
+    detect_remaining_spans(data, summary->spans,
+                           summary->columns * job->samples_per_pixel / data->channels);
+
+    free_span_detectors(job->spans, job->block_count * data->channels);
+    job->spans = NULL;
+}
+
+
+
+// ParallelTask reducing a block of columns of every channel of a summary
+static void summarize_waveform_block(void *context, int block) {
+    SummaryJob *job = (SummaryJob *) context;
+    AudioData *data = job->data;
+    WaveformSummary *summary = job->summary;
+    int columns = summary->columns;
+    int samples_per_pixel = job->samples_per_pixel;
+    int sample_min = job->sample_min;
+    int sample_max = job->sample_max;
+    double sample_range = (double) sample_max - sample_min; // total range of values a sample can have
+
+    int first_x = block * BLOCK_COLUMNS;
+    int last_x = first_x + BLOCK_COLUMNS < columns ? first_x + BLOCK_COLUMNS : columns;
+    int first_sample = first_x * samples_per_pixel / data->channels;
+
+    SpanDetector *spans = job->spans ? &job->spans[block * data->channels] : NULL;
+    BandSplitter splitter;
+
+    // for each channel in the input file
+    int c;
+    for (c = 0; c < data->channels; ++c) {
+        // each channel runs through its own crossover
+        init_band_splitter(&splitter, data->sample_rate);
+
+        if (band_colors) {
+            warm_up_band_splitter(&splitter, data, c, first_sample, sample_min, sample_range);
+        }
+
+        if (spans) {
+            start_span_detector(&spans[c], first_sample);
+        }
+
+        // for each column of pixels in the block
+        int x;
+        for (x = first_x; x < last_x && !cancelled; ++x) {
+            // find the minimum sample value, and the maximum
+            // sample value within the the range of samples that fit within this column of pixels
+            double min = sample_max;
+            double max = sample_min;
+
+            // find out the min and max sample values in this column of pixels
+            int i;
+            for (i = c; i < samples_per_pixel; i += data->channels) {
+                int index = x * samples_per_pixel + i;
+                double value = get_sample(data, index);
+
+                if (value < min) {
+                    min = value;
+                }
+
+                if (value > max) {
+                    max = value;
+                }
+
+                if (band_colors || spans) {
+                    double normalized = (value - sample_min) * 2.0 / sample_range - 1.0;
+
+                    if (band_colors) {
+                        split_bands(&splitter, normalized);
+                    }
+
+                    if (spans) {
+                        detect_spans(&spans[c], normalized, index / data->channels);
+                    }
+                }
+            }
+
+            if (min <= max) {
+                summary->min[c * columns + x] = (min - sample_min) * 2.0 / sample_range - 1.0;
+                summary->max[c * columns + x] = (max - sample_min) * 2.0 / sample_range - 1.0;
+            }
+
+            if (band_colors) {
+                store_band_energy(&splitter, &summary->energy[(c * columns + x) * 3]);
+            }
+        }
+    }
+}
+
+
+
+// reduce the samples in the given AudioData struct to the lowest and highest sample in each
+// of `columns` columns, for each channel.
+//
+// Blocks of columns are reduced on different threads (-j). Blocks are always the same size
+// and never depend on each other's results, so the summary comes out the same no matter how
+// many threads there are.
+WaveformSummary *summarize_waveform(AudioData *data, int columns) {
+    WaveformSummary *summary = create_summary(columns, data->channels);
+    SummaryJob job;
+
+    if (summary == NULL) {
+        return NULL;
+    }
+
+    if (!init_summary_job(&job, data, summary)) {
+        free_summary(summary);
+        return NULL;
+    }
+
+    run_parallel(summarize_waveform_block, &job, job.block_count);
+    finish_summary_job(&job);
+
+    return summary;
+}
+
+
+
+// ParallelTask reducing a block of columns of a summary of all channels averaged together
+static void summarize_combined_waveform_block(void *context, int block) {
+    SummaryJob *job = (SummaryJob *) context;
+    AudioData *data = job->data;
+    WaveformSummary *summary = job->summary;
+    int columns = summary->columns;
+    int samples_per_pixel = job->samples_per_pixel;
+    int sample_min = job->sample_min;
+    int sample_max = job->sample_max;
+    double sample_range = (double) sample_max - sample_min; // total range of values a sample can have
+
+    // multipliers used to produce averages while iterating through samples.
+    double channel_average_multiplier = 1.0 / data->channels;
+
+    int first_x = block * BLOCK_COLUMNS;
+    int last_x = first_x + BLOCK_COLUMNS < columns ? first_x + BLOCK_COLUMNS : columns;
+    int first_sample = first_x * samples_per_pixel / data->channels;
+
+    // silence and clipping are still looked for in each channel, before they're averaged
+    SpanDetector *spans = job->spans ? &job->spans[block * data->channels] : NULL;
+    BandSplitter splitter;
+    int c;
+
+    init_band_splitter(&splitter, data->sample_rate);
+
+    if (band_colors) {
+        warm_up_band_splitter(&splitter, data, -1, first_sample, sample_min, sample_range);
+    }
+
+    for (c = 0; spans && c < data->channels; ++c) {
+        start_span_detector(&spans[c], first_sample);
+    }
+
+    // for each column of pixels in the block
+    int x;
+    for (x = first_x; x < last_x && !cancelled; ++x) {
+        // find the minimum sample value, and the maximum
+        // sample value within the the range of samples that fit within this column of pixels
+        double min = sample_max;
+        double max = sample_min;
+
+        //for each "sample", which is really a sample for each channel,
+        //reduce the samples * channels value to a single value that is
+        //the average of the samples for each channel.
+        int i;
+        for (i = 0; i < samples_per_pixel; i += data->channels) {
+            double value = 0;
+
+            for (c = 0; c < data->channels; ++c) {
+                int index = x * samples_per_pixel + i + c;
+                double sample = get_sample(data, index);
+
+                value += sample * channel_average_multiplier;
+
+                if (spans) {
+                    detect_spans(&spans[c], (sample - sample_min) * 2.0 / sample_range - 1.0,
+                                 index / data->channels);
+                }
+            }
+
+            if (value < min) {
+                min = value;
+            }
+
+            if (value > max) {
+                max = value;
+            }
+
+            if (band_colors) {
+                split_bands(&splitter, (value - sample_min) * 2.0 / sample_range - 1.0);
+            }
+        }
+
+        if (min <= max) {
+            summary->min[x] = (min - sample_min) * 2.0 / sample_range - 1.0;
+            summary->max[x] = (max - sample_min) * 2.0 / sample_range - 1.0;
+        }
+
+        if (band_colors) {
+            store_band_energy(&splitter, &summary->energy[x * 3]);
+        }
+    }
+}
+
+
+
+// reduce the samples in the given AudioData struct to the lowest and highest value in each of
+// `columns` columns, after combining all channels into a single channel by averaging them.
+// Split across threads just like `summarize_waveform`.
+WaveformSummary *summarize_combined_waveform(AudioData *data, int columns) {
+    WaveformSummary *summary = create_summary(columns, 1);
+    SummaryJob job;
+
+    if (summary == NULL) {
+        return NULL;
+    }
+
+    if (!init_summary_job(&job, data, summary)) {
+        free_summary(summary);
+        return NULL;
+    }
+
+    run_parallel(summarize_combined_waveform_block, &job, job.block_count);
+    finish_summary_job(&job);
+
+    return summary;
+}
+
+
+
+// reduce the given audio to a fine grained summary with a column for every
+// FINE_SUMMARY_BIN_SIZE samples, which can be shrunk to any width later on
+WaveformSummary *get_fine_summary(AudioData *data, int monofy) {
+    int columns = data->size / data->sample_size / data->channels / FINE_SUMMARY_BIN_SIZE;
+
+    if (columns < 1) {
+        columns = 1;
+    }
+
+    if (monofy) {
+        return summarize_combined_waveform(data, columns);
+    }
+
+    return summarize_waveform(data, columns);
+}
+
+
+
+// shrink (or stretch) the given summary to the given number of columns. Each new column takes
+// the lowest min and highest max of the columns it covers, and adds up their band energies,
+// so it comes out the same as summarizing the samples of those columns directly would.
+WaveformSummary *resize_summary(WaveformSummary *source, int columns) {
+    WaveformSummary *summary = create_summary(columns, source->channels);
+    int c;
+    int x;
+
+    if (summary == NULL) {
+        return NULL;
+    }
+
+    for (c = 0; c < source->channels; ++c) {
+        for (x = 0; x < columns; ++x) {
+            int first = (int) ((int64_t) x * source->columns / columns);
+            int last = (int) ((int64_t) (x + 1) * source->columns / columns);
+            int index = c * columns + x;
+            int i;
+
+            // stretching. Every new column needs at least one old column.
+            if (last <= first) {
+                last = first + 1;
+            }
+
+            for (i = c * source->columns + first; i < c * source->columns + last; ++i) {
+                if (source->min[i] < summary->min[index]) {
+                    summary->min[index] = source->min[i];
+                }
+
+                if (source->max[i] > summary->max[index]) {
+                    summary->max[index] = source->max[i];
+                }
+
+                if (summary->energy && source->energy) {
+                    summary->energy[index * 3] += source->energy[i * 3];
+                    summary->energy[index * 3 + 1] += source->energy[i * 3 + 1];
+                    summary->energy[index * 3 + 2] += source->energy[i * 3 + 2];
+                }
+            }
+        }
+    }
+
+    return summary;
+}
+
+
+
+// merge every channel of the given summary into one, taking the lowest min and highest max of
+// all channels for each column. This is an envelope of the channels rather than the average
+// `summarize_combined_waveform` makes, but it only needs the summary, not the samples.
+WaveformSummary *merge_summary_channels(WaveformSummary *source) {
+    WaveformSummary *summary = create_summary(source->columns, 1);
+    int c;
+    int x;
+
+    if (summary == NULL) {
+        return NULL;
+    }
+
+    for (c = 0; c < source->channels; ++c) {
+        for (x = 0; x < source->columns; ++x) {
+            int i = c * source->columns + x;
+
+            if (source->min[i] < summary->min[x]) {
+                summary->min[x] = source->min[i];
+            }
+
+            if (source->max[i] > summary->max[x]) {
+                summary->max[x] = source->max[i];
+            }
+
+            if (summary->energy && source->energy) {
+                summary->energy[x * 3] += source->energy[i * 3];
+                summary->energy[x * 3 + 1] += source->energy[i * 3 + 1];
+                summary->energy[x * 3 + 2] += source->energy[i * 3 + 2];
+            }
+        }
+    }
+
+    return summary;
+}
+
+
+
+// compare two doubles for qsort
+static int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+
+    return (da > db) - (da < db);
+}
+
+
+
+// figure out how much the waveform in the given summary needs to be scaled so that the
+// `auto_gain` percentile of its column peaks reaches full height (-g). Only the column
+// summaries are looked at, never the samples. Returns 1.0 if auto gain is off.
+double get_auto_gain(WaveformSummary *summary) {
+    int count = summary->columns * summary->channels;
+    int peak_count = 0;
+    double gain = 1.0;
+    int i;
+
+    if (auto_gain <= 0.0) {
+        return 1.0;
+    }
+
+    double *peaks = malloc(sizeof(double) * count);
+
+    if (peaks == NULL) {
+        return 1.0;
+    }
+
+    // the loudest point of each column, skipping empty ones
+    for (i = 0; i < count; ++i) {
+        if (summary->min[i] <= summary->max[i]) {
+            peaks[peak_count++] = fmax(fabs(summary->min[i]), fabs(summary->max[i]));
+        }
+    }
+
+    if (peak_count > 0) {
+        qsort(peaks, peak_count, sizeof(double), compare_doubles);
+
+        int index = (int) ceil(auto_gain / 100.0 * peak_count) - 1;
+        double level = peaks[index < 0 ? 0 : index];
+
+        if (level > 0.0) {
+            gain = 1.0 / level;
+        }
+
+        // don't blow the noise floor of a silent file up to full height
+        if (gain > AUTO_GAIN_MAX) {
+            gain = AUTO_GAIN_MAX;
+        }
+    }
+
+    free(peaks);
+
+    return gain;
+}
+
+
+
+// apply the auto gain (-g) and log scaling (-l) to a normalized sample value
+static double scale_sample(double value, double gain) {
+    value *= gain;
+
+    // anything the gain pushed past full scale gets cut off at the edge of the channel
+    if (value < -1.0) {
+        value = -1.0;
+    } else if (value > 1.0) {
+        value = 1.0;
+    }
+
+    if (log_scale) {
+        // map 0 dB to full height and LOG_SCALE_DB_RANGE below it to the center line
+        double magnitude = fabs(value);
+        double level = magnitude > 0.0 ? 1.0 + 20.0 * log10(magnitude) / LOG_SCALE_DB_RANGE : 0.0;
+
+        if (level < 0.0) {
+            level = 0.0;
+        }
+
+        value = value < 0.0 ? -level : level;
+    }
+
+    return value;
+}
+
+
+
+// ParallelTask drawing a block of columns of every channel of a waveform
+static void draw_waveform_block(void *context, int block) {
+    WaveformDrawing *drawing = (WaveformDrawing *) context;
+    WaveformPNG *png = drawing->png;
+    WaveformSummary *summary = drawing->summary;
+    int padding = drawing->padding;
+
+    int first_x = block * BLOCK_COLUMNS;
+    int last_x = first_x + BLOCK_COLUMNS < png->width ? first_x + BLOCK_COLUMNS : png->width;
+
+    // color of the column being drawn. Only changes from the waveform color with -B
+    png_byte color[4];
+
+    memcpy(color, color_waveform, 4);
+
+    // for each channel in the input file
+    int c;
+    for (c = 0; c < summary->channels; ++c) {
+        int channel_height = drawing->heights[c];
+        int start_y = drawing->start_y[c];
+        int end_y = drawing->end_y[c];
+
+        // for each column of pixels in the block
+        int x;
+        for (x = first_x; x < last_x; ++x) {
+            int index = c * summary->columns + x;
+            double min = scale_sample(summary->min[index], drawing->gain);
+            double max = scale_sample(summary->max[index], drawing->gain);
+
+            if (summary->energy) {
+                get_band_color(&summary->energy[index * 3], color);
+            }
+
+            // calculate where to draw the waveform in the channel range
+            int waveform_top = (max + 1.0) * channel_height / 2.0;
+            int waveform_bottom = (min + 1.0) * channel_height / 2.0;
+
+            // flip it (drawing coordinates go from 0 to h, but audio wants positive samples
+            // on top and negative samples below with 0 in the center of the channel
+            waveform_bottom = channel_height - waveform_bottom;
+            waveform_top = channel_height - waveform_top;
+
+            // offset calculations to account for padding on the top
+            waveform_top += start_y + padding;
+            waveform_bottom += start_y + padding;
+            
+            draw_column_segment(png, x, start_y, end_y, waveform_top, waveform_bottom, color);
+        }
+    }
+}
+
+
+
+// take the given WaveformPNG struct and draw an audio waveform for each channel of the given
+// summary, stacked on top of each other. Blocks of columns are drawn on different threads
+// (-j); each block is a whole number of cache lines of every row, so threads never write to
+// the same line.
+void draw_waveform(WaveformPNG *png, WaveformSummary *summary) {
+    WaveformDrawing drawing;
+
+    // make it so that the total amount of padding is 10% of the height of the image
+    int padding = (int) (png->height * 0.1 / summary->channels);
+
+    // how tall should each channel be. Because the height is variable, it is quite possible
+    // that each channel height will not be uniform. Figure out how big each channel would
+    // be in a perfect world, and then figure out how wrong our guess is so we can correct for
+    // it later.
+    double ch = (png->height - (padding * (summary->channels + 1))) / (double) summary->channels;
+    double lost_height = ch - floor(ch);
+    int base_channel_height = floor(ch);
+
+    // as we iterate, we'll see which channel needs additional height to account for floating
+    // point/rounding errors. whenever total_lost_height becomes > 1, it means we need to
+    // add an additional pixel (or possibly more) to this channel height.
+    double total_lost_height = 0.0;
+
+    int start_y = 0; //where should we start drawing this channel (include TOP padding only)
+    int end_y = 0; //where should we stop drawing this channel (include TOP padding only)
+
+    drawing.png = png;
+    drawing.summary = summary;
+    drawing.padding = padding;
+    drawing.gain = get_auto_gain(summary);
+    drawing.start_y = malloc(sizeof(int) * summary->channels);
+    drawing.end_y = malloc(sizeof(int) * summary->channels);
+    drawing.heights = malloc(sizeof(int) * summary->channels);
+
+    if (!drawing.start_y || !drawing.end_y || !drawing.heights) {
+        goto END;
+    }
+
+    // lay out each channel in the input file
+    int c;
+    for (c = 0; c < summary->channels; ++c) {
+        int channel_height = base_channel_height;
+
+        // does this channel need to be boosted in height because of rounding errors?
+        total_lost_height += lost_height;
+
+        if (total_lost_height > 1) {
+            // yes.
+            channel_height += total_lost_height - floor(total_lost_height);
+            total_lost_height -= floor(total_lost_height);
+        }
+
+        // figure out the start and end heights for drawing this channel
+        start_y = end_y;
+        end_y = start_y + channel_height + padding;
+
+        // if this is the last channel being drawn, set the end to be the bottom of the image.
+        // this is sufficient enough to add the padding to the bottom of the image and correct
+        // for any remaining rounding errors
+        if (c == summary->channels - 1) {
+            end_y = png->height - 1;
+        }
+
+        drawing.heights[c] = channel_height;
+        drawing.start_y[c] = start_y;
+        drawing.end_y[c] = end_y;
+    }
+
+    run_parallel(draw_waveform_block, &drawing, (png->width + BLOCK_COLUMNS - 1) / BLOCK_COLUMNS);
+
+END:
+    free(drawing.start_y);
+    free(drawing.end_y);
+    free(drawing.heights);
+}
+
+
+
+// ParallelTask drawing a block of columns of a single waveform filling the whole image
+static void draw_combined_waveform_block(void *context, int block) {
+    WaveformDrawing *drawing = (WaveformDrawing *) context;
+    WaveformPNG *png = drawing->png;
+    WaveformSummary *summary = drawing->summary;
+    int padding = drawing->padding;
+    int track_height = drawing->heights[0];
+    int last_y = drawing->end_y[0];
+
+    int first_x = block * BLOCK_COLUMNS;
+    int last_x = first_x + BLOCK_COLUMNS < png->width ? first_x + BLOCK_COLUMNS : png->width;
+
+    // color of the column being drawn. Only changes from the waveform color with -B
+    png_byte color[4];
+
+    memcpy(color, color_waveform, 4);
+
+    // for each column of pixels in the block
+    int x;
+    for (x = first_x; x < last_x; ++x) {
+        double min = scale_sample(summary->min[x], drawing->gain);
+        double max = scale_sample(summary->max[x], drawing->gain);
+
+        if (summary->energy) {
+            get_band_color(&summary->energy[x * 3], color);
+        }
+
+        // calculate the y pixel values that represent the waveform for this column of pixels.
+        // they are subtracted from last_y to flip the waveform image, putting positive
+        // numbers above the center of waveform and negative numbers below.
+        int y_max = track_height - ((min + 1.0) * track_height / 2.0) + padding;
+        int y_min = track_height - ((max + 1.0) * track_height / 2.0) + padding;
+
+        draw_column_segment(png, x, 0, last_y, y_min, y_max, color);
+    }
+}
+
+
+
+// take the given WaveformPNG struct and draw the single waveform of the given summary
+// (made by `summarize_combined_waveform`) filling the whole image. Split across threads
+// just like `draw_waveform`.
+void draw_combined_waveform(WaveformPNG *png, WaveformSummary *summary) {
+    WaveformDrawing drawing;
+    int start_y = 0;
+    int last_y = png->height - 1; // count of pixels in height starting from 0
+
+    // 10% padding
+    int padding = (int) (png->height * 0.05);
+    int track_height = png->height - (padding * 2);
+
+    drawing.png = png;
+    drawing.summary = summary;
+    drawing.padding = padding;
+    drawing.gain = get_auto_gain(summary);
+    drawing.start_y = &start_y;
+    drawing.end_y = &last_y;
+    drawing.heights = &track_height;
+
+    run_parallel(draw_combined_waveform_block, &drawing,
+                 (png->width + BLOCK_COLUMNS - 1) / BLOCK_COLUMNS);
+}
+
+
+
+// free an FFT created by `create_fft`
+static void free_fft(FFT *fft) {
+    if (fft == NULL) {
+        return;
+    }
+
+    free(fft->bit_reverse);
+    free(fft->twiddle_re);
+    free(fft->twiddle_im);
+    free(fft->split_re);
+    free(fft->split_im);
+    free(fft->window);
+    free(fft);
+}
+
+
+
+// precompute everything needed to run real-input FFTs of the given size (a power of two).
+// Returns NULL if memory couldn't be allocated.
+static FFT *create_fft(int size) {
+    FFT *fft = calloc(1, sizeof(FFT));
+    int bits = 0;
+    int span;
+    int i;
+
+    if (fft == NULL) {
+        return NULL;
+    }
+
+    fft->size = size;
+    fft->half = size / 2;
+
+    while ((1 << bits) < fft->half) {
+        ++bits;
+    }
+
+    fft->bit_reverse = malloc(sizeof(int) * fft->half);
+    fft->twiddle_re = malloc(sizeof(float) * fft->half);
+    fft->twiddle_im = malloc(sizeof(float) * fft->half);
+    fft->split_re = malloc(sizeof(float) * (fft->half + 1));
+    fft->split_im = malloc(sizeof(float) * (fft->half + 1));
+    fft->window = malloc(sizeof(float) * size);
+
+    if (!fft->bit_reverse || !fft->twiddle_re || !fft->twiddle_im ||
+            !fft->split_re || !fft->split_im || !fft->window) {
+        free_fft(fft);
+        return NULL;
+    }
+
+    for (i = 0; i < fft->half; ++i) {
+        int reversed = 0;
+        int b;
+
+        for (b = 0; b < bits; ++b) {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+
+        fft->bit_reverse[i] = reversed;
+    }
+
+    // the twiddle factors for the stage that merges blocks of `span` into blocks of `span * 2`
+    // are stored next to each other starting at index `span - 1`, so the butterfly loop reads
+    // them straight through instead of striding over one big table.
+    for (span = 1; span < fft->half; span <<= 1) {
+        for (i = 0; i < span; ++i) {
+            fft->twiddle_re[span - 1 + i] = cos(-M_PI * i / span);
+            fft->twiddle_im[span - 1 + i] = sin(-M_PI * i / span);
+        }
+    }
+
+    for (i = 0; i <= fft->half; ++i) {
+        fft->split_re[i] = cos(-2.0 * M_PI * i / size);
+        fft->split_im[i] = sin(-2.0 * M_PI * i / size);
+    }
+
+    for (i = 0; i < size; ++i) {
+        fft->window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / size);
+    }
+
+    return fft;
+}
+
+
+
+// window the `fft->size` real samples in `input`, run them through the FFT and put the power
+// (magnitude squared) of each of the `fft->half + 1` frequency bins into `power`.
+//
+// `re` and `im` are scratch buffers of at least `fft->half` floats. Each thread needs its own.
+//
+// The real input is packed into a complex FFT of half the size (even samples as the real part,
+// odd samples as the imaginary part), and the two interleaved spectrums are untangled at the
+// end. That's about half the work of a complex FFT of the full size.
+static void fft_power(FFT *fft, const float *input, float *re, float *im, float *power) {
+    int half = fft->half;
+    int span;
+    int i;
+
+    for (i = 0; i < half; ++i) {
+        int j = fft->bit_reverse[i];
+
+        re[j] = input[2 * i] * fft->window[2 * i];
+        im[j] = input[2 * i + 1] * fft->window[2 * i + 1];
+    }
+
+    // iterative radix-2 butterflies, one stage at a time
+    for (span = 1; span < half; span <<= 1) {
+        const float *twiddle_re = fft->twiddle_re + span - 1;
+        const float *twiddle_im = fft->twiddle_im + span - 1;
+        int block;
+
+        for (block = 0; block < half; block += span * 2) {
+            float *even_re = re + block;
+            float *even_im = im + block;
+            float *odd_re = re + block + span;
+            float *odd_im = im + block + span;
+
+            for (i = 0; i < span; ++i) {
+                float t_re = odd_re[i] * twiddle_re[i] - odd_im[i] * twiddle_im[i];
+                float t_im = odd_re[i] * twiddle_im[i] + odd_im[i] * twiddle_re[i];
+
+                odd_re[i] = even_re[i] - t_re;
+                odd_im[i] = even_im[i] - t_im;
+                even_re[i] += t_re;
+                even_im[i] += t_im;
+            }
+        }
+    }
+
+    // untangle the spectrum of the even samples and the spectrum of the odd samples, and
+    // combine them into the spectrum of the whole input
+    for (i = 0; i <= half; ++i) {
+        int k = i == half ? 0 : i;
+        int m = i == 0 ? 0 : half - i;
+
+        float even_re = (re[k] + re[m]) * 0.5f;
+        float even_im = (im[k] - im[m]) * 0.5f;
+        float odd_re = (im[k] + im[m]) * 0.5f;
+        float odd_im = (re[m] - re[k]) * 0.5f;
+
+        float x_re = even_re + fft->split_re[i] * odd_re - fft->split_im[i] * odd_im;
+        float x_im = even_im + fft->split_re[i] * odd_im + fft->split_im[i] * odd_re;
+
+        power[i] = x_re * x_re + x_im * x_im;
+    }
+}
+
+
+
+// fill the given 256 entry lookup table with the spectrogram's colors, going from black
+// through purple, red and orange up to pale yellow for the loudest frequencies
+static void init_spectrogram_colors(png_byte (*colors)[4]) {
+    static const double stops[][3] = {
+        {0, 0, 0},
+        {60, 15, 110},
+        {190, 40, 80},
+        {250, 140, 30},
+        {255, 255, 210}
+    };
+    int stop_count = sizeof(stops) / sizeof(stops[0]);
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        double position = i / 255.0 * (stop_count - 1);
+        int stop = (int) position;
+        double t = position - stop;
+        int c;
+
+        if (stop >= stop_count - 1) {
+            stop = stop_count - 2;
+            t = 1.0;
+        }
+
+        for (c = 0; c < 3; ++c) {
+            colors[i][c] = (png_byte) (stops[stop][c] + (stops[stop + 1][c] - stops[stop][c]) * t);
+        }
+
+        colors[i][3] = 255;
+    }
+}
+
+
+
+// copy `fft->size` samples of the given band (a channel, or all channels averaged if there's
+// only one band), centered on `position`, into `input` normalized to -1.0 to 1.0. Frames are
+// kept inside the audio where possible so the edges of the image don't show the jump into
+// silence. Anything before the start or past the end of the audio is silence.
+static void read_spectrogram_frame(Spectrogram *spectrogram, int band, int64_t position, float *input) {
+    AudioData *data = spectrogram->data;
+    int size = spectrogram->fft->size;
+    int sample_min;
+    int sample_max;
+    int i;
+
+    get_format_range(data->format, &sample_min, &sample_max);
+
+    double sample_range = (double) sample_max - sample_min;
+    int64_t start = position - size / 2;
+
+    if (start + size > spectrogram->sample_count) {
+        start = spectrogram->sample_count - size;
+    }
+
+    if (start < 0) {
+        start = 0;
+    }
+
+    for (i = 0; i < size; ++i) {
+        int64_t sample = start + i;
+        double value = 0.0;
+
+        if (sample >= 0 && sample < spectrogram->sample_count) {
+            if (spectrogram->bands == data->channels) {
+                value = get_sample(data, sample * data->channels + band);
+            } else {
+                int c;
+
+                for (c = 0; c < data->channels; ++c) {
+                    value += get_sample(data, sample * data->channels + c);
+                }
+
+                value /= data->channels;
+            }
+
+            value = (value - sample_min) * 2.0 / sample_range - 1.0;
+        }
+
+        input[i] = (float) value;
+    }
+}
+
+
+
+// ParallelTask drawing a block of columns of a spectrogram
+static void draw_spectrogram_block(void *context, int block) {
+    Spectrogram *spectrogram = (Spectrogram *) context;
+    WaveformPNG *png = spectrogram->png;
+    FFT *fft = spectrogram->fft;
+    int bins = fft->half + 1;
+
+    // power of a full scale sine wave, after the Hann window halves it, so 0 dB is full scale
+    double reference = (fft->size / 4.0) * (fft->size / 4.0);
+
+    // scratch space for this thread
+    float *input = malloc(sizeof(float) * fft->size);
+    float *re = malloc(sizeof(float) * fft->half);
+    float *im = malloc(sizeof(float) * fft->half);
+    float *power = malloc(sizeof(float) * bins);
+    float *column_power = malloc(sizeof(float) * bins);
+
+    int first_x = block * BLOCK_COLUMNS;
+    int last_x = first_x + BLOCK_COLUMNS;
+    int x;
+
+    if (!input || !re || !im || !power || !column_power) {
+        goto END;
+    }
+
+    if (last_x > png->width) {
+        last_x = png->width;
+    }
+
+    for (x = first_x; x < last_x; ++x) {
+        // range of samples this column of pixels covers
+        int64_t start = (int64_t) x * spectrogram->sample_count / png->width;
+        int64_t end = (int64_t) (x + 1) * spectrogram->sample_count / png->width;
+        int band;
+        int y;
+
+        for (band = 0; band < spectrogram->bands; ++band) {
+            int frames = 0;
+            int64_t position;
+            int i;
+
+            memset(column_power, 0, sizeof(float) * bins);
+
+            // average the power of every FFT that starts in this column. If the hop is bigger
+            // than a column (or there is no hop), fall back to one FFT in the middle.
+            if (spectrogram->hop > 0) {
+                position = (start + spectrogram->hop - 1) / spectrogram->hop * spectrogram->hop;
+            } else {
+                position = end;
+            }
+
+            if (position >= end) {
+                position = start + (end - start) / 2;
+                end = position + 1;
+            }
+
+            for (; position < end; position += spectrogram->hop > 0 ? spectrogram->hop : 1) {
+                read_spectrogram_frame(spectrogram, band, position, input);
+                fft_power(fft, input, re, im, power);
+
+                for (i = 0; i < bins; ++i) {
+                    column_power[i] += power[i];
+                }
+
+                ++frames;
+            }
+
+            for (i = 0; i < bins; ++i) {
+                column_power[i] /= frames;
+            }
+
+            // restore the column's real end for the next band
+            end = (int64_t) (x + 1) * spectrogram->sample_count / png->width;
+
+            for (y = 0; y < png->height; ++y) {
+                SpectrogramRow *row = &spectrogram->rows[y];
+                double value = 0.0;
+
+                if (row->band != band) {
+                    continue;
+                }
+
+                if (row->first_bin <= row->last_bin) {
+                    // lots of bins in this row (high frequencies). Show the loudest one.
+                    for (i = row->first_bin; i <= row->last_bin; ++i) {
+                        if (column_power[i] > value) {
+                            value = column_power[i];
+                        }
+                    }
+                } else {
+                    // the row is narrower than a bin (low frequencies). Interpolate.
+                    int bin = (int) row->center_bin;
+                    double t = row->center_bin - bin;
+
+                    value = column_power[bin] * (1.0 - t) + column_power[bin + 1 < bins ? bin + 1 : bin] * t;
+                }
+
+                double db = 10.0 * log10(value / reference + 1e-20);
+                double level = (db + SPECTROGRAM_DB_RANGE) / SPECTROGRAM_DB_RANGE;
+
+                if (level < 0.0) {
+                    level = 0.0;
+                } else if (level > 1.0) {
+                    level = 1.0;
+                }
+
+                memcpy(png->pRows[y] + x * 4, spectrogram->colors[(int) (level * 255)], 4);
+            }
+        }
+    }
+
+END:
+    free(input);
+    free(re);
+    free(im);
+    free(power);
+    free(column_power);
+}
+
+
+
+// take the given WaveformPNG struct and draw a spectrogram of the audio in the given AudioData
+// struct, with time going left to right and a log frequency axis going up from 20 Hz to half
+// the sample rate. Each channel gets its own spectrogram stacked on top of each other, unless
+// `monofy` is set, in which case all channels are averaged into one.
+//
+// Columns of the image are drawn in blocks spread across threads (-j).
+void draw_spectrogram(WaveformPNG *png, AudioData *data, int monofy) {
+    Spectrogram spectrogram;
+    png_byte colors[256][4];
+    int y;
+
+    spectrogram.png = png;
+    spectrogram.data = data;
+    spectrogram.bands = monofy ? 1 : data->channels;
+    spectrogram.sample_count = data->size / data->sample_size / data->channels;
+    spectrogram.hop = spectrogram_hop;
+    spectrogram.colors = colors;
+    spectrogram.fft = create_fft(spectrogram_size);
+    spectrogram.rows = malloc(sizeof(SpectrogramRow) * png->height);
+
+    if (spectrogram.fft == NULL || spectrogram.rows == NULL) {
+        fprintf(stderr, "Could not allocate spectrogram\n");
+        free_fft(spectrogram.fft);
+        free(spectrogram.rows);
+        return;
+    }
+
+    init_spectrogram_colors(colors);
+
+    // figure out which frequencies each row of pixels shows, once, instead of for every column
+    double bin_width = (double) data->sample_rate / spectrogram_size;
+    double max_frequency = data->sample_rate / 2.0;
+    double min_frequency = SPECTROGRAM_MIN_FREQUENCY > bin_width ? SPECTROGRAM_MIN_FREQUENCY : bin_width;
+
+    for (y = 0; y < png->height; ++y) {
+        SpectrogramRow *row = &spectrogram.rows[y];
+
+        // which band this row is in, and where the band starts and ends
+        int band = (int) ((int64_t) y * spectrogram.bands / png->height);
+        int band_top = (int) ((int64_t) band * png->height / spectrogram.bands);
+        int band_bottom = (int) ((int64_t) (band + 1) * png->height / spectrogram.bands);
+
+        // with fewer rows than bands, a band can round down to no rows at all. Give the row
+        // its band to itself then.
+        if (band_bottom <= y) {
+            band_bottom = y + 1;
+        }
+
+        int band_height = band_bottom - band_top;
+
+        // position of the row's bottom and top edges within the band, from 0.0 to 1.0
+        double bottom = (double) (band_bottom - y - 1) / band_height;
+        double top = (double) (band_bottom - y) / band_height;
+
+        double low = min_frequency * pow(max_frequency / min_frequency, bottom) / bin_width;
+        double high = min_frequency * pow(max_frequency / min_frequency, top) / bin_width;
+
+        row->band = band;
+        row->first_bin = (int) ceil(low);
+        row->last_bin = (int) floor(high);
+        row->center_bin = (float) ((low + high) / 2.0);
+
+        if (row->last_bin > spectrogram.fft->half) {
+            row->last_bin = spectrogram.fft->half;
+        }
+    }
+
+    run_parallel(draw_spectrogram_block, &spectrogram, (png->width + BLOCK_COLUMNS - 1) / BLOCK_COLUMNS);
+
+    free_fft(spectrogram.fft);
+    free(spectrogram.rows);
+}
+
+
+
+// print out help text saying how to use this program and exit
+void help() {
+    printf("%s\n\n", version);
     printf("NAME\n\n");
     printf("    waveform - generates a png image of the waveform of a given audio file.\n\n");
     printf("SYNOPSIS\n\n");
@@ -520,9 +2408,32 @@ void help() {
     printf("    (more accurate than ffprobe can be depending on the input format) via\n");
     printf("    the -d option.\n\n");
     printf("OPTIONS\n\n");
+    printf("    -a\n");
+    printf("            Read every audio track of the input instead of just the best one.\n");
+    printf("            All tracks are decoded in a single pass over the file and drawn\n");
+    printf("            stacked in one image, in the order they appear in the file. If\n");
+    printf("            the -o file name contains %%d, each track is written to its own\n");
+    printf("            image instead, with %%d replaced by the track's stream index.\n\n");
+    printf("    -B\n");
+    printf("            Color the waveform by its frequency content, like DJ software does.\n");
+    printf("            The audio is split into low (below 200 Hz), mid and high (above\n");
+    printf("            2 kHz) bands while it is scanned, and each column is drawn in a\n");
+    printf("            blend of red, green and blue weighted by how loud each band is in\n");
+    printf("            that column. Kicks and bass come out red, hi-hats and cymbals blue.\n");
+    printf("            Only the alpha of the -c color is used.\n\n");
     printf("    -b HEX [default ffffffff]\n");
     printf("            Set the background color of the image. Color is specified in hex\n");
     printf("            format: RRGGBBAA or 0xRRGGBBAA.\n\n");
+    printf("    -C CHANNELS\n");
+    printf("            Only read some of the channels of the input, or mix them down,\n");
+    printf("            for surround and ambisonic files. CHANNELS is a comma separated\n");
+    printf("            list of the channels to draw. Each is a channel of the input: an\n");
+    printf("            index counting from 0, an ffmpeg channel name (FL, FR, FC, LFE,\n");
+    printf("            BL, BR, SL, SR...), or L, R or C. Channels joined with + are\n");
+    printf("            averaged into one, and W* gives a channel a weight instead, so\n");
+    printf("            -C L+R,C draws a stereo downmix and the center channel, and\n");
+    printf("            -C 0.7*FL+0.7*BL mixes two channels at 0.7 each. Channels that\n");
+    printf("            aren't used are never copied out of the decoded audio.\n\n");
     printf("    -c HEX [default 595959ff]\n");
     printf("            Set the color of the waveform. Color is specified in hex format:\n");
     printf("            RRGGBBAA or 0xRRGGBBAA\n\n");
@@ -530,7 +2441,23 @@ void help() {
     printf("            Do not generate an image, but instead print out file metadata to\n");
     printf("            standard out. This is mostly useful to find the actual duration\n");
     printf("            of an input file, since ffprobe can occasionally be inacurate in\n");
-    printf("            its prediction of duration.\n\n");
+    printf("            its prediction of duration. Also prints how much time and I/O it\n");
+    printf("            took to open and read the input.\n\n");
+    printf("    -f\n");
+    printf("            Fast start. Spend as little time as possible figuring out the\n");
+    printf("            streams of the input before decoding: probing is limited to the\n");
+    printf("            first 64k / half second of the input and skipped entirely if the\n");
+    printf("            container header says enough about the audio, and the demuxer is\n");
+    printf("            told to skip over anything that isn't audio. Mostly useful for\n");
+    printf("            the audio of large video files. Use with -d to see the effect.\n\n");
+    printf("    -g peak|PERCENTILE\n");
+    printf("            Automatically scale the waveform to fill its height, for quiet\n");
+    printf("            recordings that would otherwise be drawn as a flat line. With\n");
+    printf("            peak, the loudest point of the audio reaches full height. With a\n");
+    printf("            percentile (such as 99), that percentile of the loudest point of\n");
+    printf("            each column does, so a few loud clicks don't keep the rest of the\n");
+    printf("            audio small. Anything scaled past full height is cut off. The\n");
+    printf("            waveform is boosted by at most 40 dB.\n\n");
     printf("    -h NUM\n");
     printf("            Height of output image. The height of each channel will be\n\n");
     printf("            constrained so that all channels can fit within the specified\n\n");
@@ -543,7 +2470,31 @@ void help() {
     printf("            file. If not, the output image will have a height of -h.\n\n");
     printf("    -i FILE\n");
     printf("            Input file to parse. Can be any format/codec that can be read by\n");
-    printf("            the installed ffmpeg.\n\n");
+    printf("            the installed ffmpeg. Use - to read the input from stdin.\n\n");
+    printf("            If -i is given more than once, the files are drawn end to end in\n");
+    printf("            one waveform, each taking up a part of the width proportional to\n");
+    printf("            its duration, such as for an overview of an album. The files are\n");
+    printf("            decoded at the same time (see -j). If they don't all have the\n");
+    printf("            same number of channels, each file's channels are merged into a\n");
+    printf("            single waveform. With -d, the metadata of each file is printed\n");
+    printf("            along with their total duration. Can't be used with -a or -S.\n\n");
+    printf("    -j NUM [default: number of CPUs]\n");
+    printf("            Number of threads to split reducing the audio to columns and\n");
+    printf("            drawing them (and decoding, when there is more than one input\n");
+    printf("            file) up between. The image comes out the same no matter how\n");
+    printf("            many threads there are.\n\n");
+    printf("    -K DIR[:MB]\n");
+    printf("            Cache a fine grained summary of each decoded input file in DIR, so\n");
+    printf("            drawing the same file again (at any size, or with another color or\n");
+    printf("            gain) skips decoding it. Entries are keyed by the file's path, size\n");
+    printf("            and modification time, and by the options that change the summary\n");
+    printf("            (-a, -B, -C and -m). Once the cache takes up more than MB megabytes\n");
+    printf("            (1024 by default), the least recently used entries are removed.\n");
+    printf("            Several processes can share DIR. Not used with stdin, -d, -r or -S.\n\n");
+    printf("    -l\n");
+    printf("            Scale the waveform in dB instead of linearly, showing the bottom\n");
+    printf("            48 dB below full scale. Quiet details become much easier to see.\n");
+    printf("            Can be combined with -g.\n\n");
     printf("    -m\n");
     printf("            Produce a single channel waveform. Each channel will be averaged\n");
     printf("            together to produce the final channel. The -h and -t options\n");
@@ -551,6 +2502,40 @@ void help() {
     printf("    -o FILE\n");
     printf("            Output file for PNG. If -o is omitted, the png will be written\n");
     printf("            to stdout.\n\n");
+    printf("    -p FD\n");
+    printf("            Report progress on file descriptor FD (such as 2 for stderr) as\n");
+    printf("            one line of JSON at a time: when the input is opened (or found in\n");
+    printf("            the cache, see -K), every half second while decoding, and when\n");
+    printf("            drawing, writing the image, and finishing (or being cancelled). The\n");
+    printf("            stage field is one of open, cached, decode, render, write, done or\n");
+    printf("            cancelled. Decoding reports include the bytes read from the input,\n");
+    printf("            the seconds of audio decoded, the duration the container claims,\n");
+    printf("            and the progress from 0 to 1. FD can only be 1 (stdout) when the\n");
+    printf("            image is written to a file with -o.\n\n");
+    printf("    -r FILE\n");
+    printf("            Look for silent and clipped spans of each channel while the audio\n");
+    printf("            is being reduced for the image, and write them to FILE as JSON:\n");
+    printf("            an array with an entry for each track drawn (or each input file),\n");
+    printf("            listing the start and end (in seconds) of every span of each\n");
+    printf("            channel. A span is clipped if at least 3 samples in a row are at\n");
+    printf("            full scale. Also works with -d, in which case the samples are\n");
+    printf("            decoded just for this.\n\n");
+    printf("    -s DB[:SECONDS] [default -60:0.5]\n");
+    printf("            How quiet audio has to be, in dB below full scale, and for how\n");
+    printf("            many seconds, to count as a silent span for -r.\n\n");
+    printf("    -S SIZE[:HOP]\n");
+    printf("            Draw a spectrogram instead of a waveform, using FFTs of SIZE\n");
+    printf("            samples (a power of two, such as 2048). Time goes left to right\n");
+    printf("            and frequency goes up from 20 Hz to half the sample rate on a log\n");
+    printf("            scale. Each channel gets its own spectrogram, or one for all of\n");
+    printf("            them with -m. If HOP is given, an FFT is run every HOP samples and\n");
+    printf("            all of the FFTs in a column of pixels are averaged. Otherwise one\n");
+    printf("            FFT is run for each column. -c and -b are ignored.\n\n");
+    printf("    -T SECONDS\n");
+    printf("            Give up if the program hasn't finished after SECONDS. Just like\n");
+    printf("            when it gets SIGINT or SIGTERM, it stops what it's doing, frees\n");
+    printf("            everything, removes the unfinished -o file, and exits with a\n");
+    printf("            status of 2.\n\n");
     printf("    -t NUM [default 64]\n");
     printf("            Height of each track in the output image. The final height of the\n");
     printf("            output png will be this value multiplied by the number of channels\n");
@@ -567,225 +2552,1975 @@ void help() {
 
 
 /*
- * Take an ffmpeg AVFormatContext and AVCodecContext struct and create and AudioData struct
- * that we can easily work with
+ * Take an ffmpeg AVFormatContext and AVCodecContext struct and create and AudioData struct
+ * that we can easily work with
+ */
+AudioData *create_audio_data_struct(AVFormatContext *pFormatContext, AVCodecContext *pDecoderContext) {
+    // Make the AudioData object we'll be returning
+    AudioData *data = malloc(sizeof(AudioData));
+    data->format_context = pFormatContext;
+    data->decoder_context = pDecoderContext;
+    data->format = pDecoderContext->sample_fmt;
+    data->sample_size = (int) av_get_bytes_per_sample(pDecoderContext->sample_fmt); // *byte* depth
+    data->channels = pDecoderContext->channels;
+    data->samples = NULL;
+    data->size = 0;
+    data->duration = 0.0;
+    data->sample_rate = 0;
+    data->allocated_size = 0;
+    data->stream_index = -1;
+    data->next = NULL;
+    data->io_context = NULL;
+    data->mix = NULL;
+    data->summary = NULL;
+    data->input_index = 0;
+    memset(&data->stats, 0, sizeof(AudioStats));
+
+    // normalize the sample format to an enum that's less verbose than AVSampleFormat.
+    // We won't care about planar/interleaved
+    switch (pDecoderContext->sample_fmt) {
+        case AV_SAMPLE_FMT_U8:
+        case AV_SAMPLE_FMT_U8P:
+            data->format = SAMPLE_FORMAT_UINT8;
+            break;
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P:
+            data->format = SAMPLE_FORMAT_INT16;
+            break;
+        case AV_SAMPLE_FMT_S32:
+        case AV_SAMPLE_FMT_S32P:
+            data->format = SAMPLE_FORMAT_INT32;
+            break;
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_FLTP:
+            data->format = SAMPLE_FORMAT_FLOAT;
+            break;
+        case AV_SAMPLE_FMT_DBL:
+        case AV_SAMPLE_FMT_DBLP:
+            data->format = SAMPLE_FORMAT_DOUBLE;
+            break;
+        default:
+            // the ffmpeg structs still belong to the caller at this point, so only free our own
+            fprintf(stderr, "Bad format: %s\n", av_get_sample_fmt_name(pDecoderContext->sample_fmt));
+            free(data);
+            return NULL;
+    }
+
+    return data;
+}
+
+
+
+// read a decoded sample of the given format, normalized to -1.0 to 1.0 the same way the
+// summaries normalize samples
+static inline float read_mix_input(ChannelMix *mix, const uint8_t *pSample) {
+    double value = 0.0;
+
+    switch (mix->input_format) {
+        case SAMPLE_FORMAT_UINT8:
+            value = *pSample;
+            break;
+        case SAMPLE_FORMAT_INT16:
+            value = *(const int16_t *) pSample;
+            break;
+        case SAMPLE_FORMAT_INT32:
+            value = *(const int32_t *) pSample;
+            break;
+        case SAMPLE_FORMAT_FLOAT:
+            return *(const float *) pSample;
+        case SAMPLE_FORMAT_DOUBLE:
+            return (float) *(const double *) pSample;
+    }
+
+    return (float) ((value - mix->input_min) * 2.0 / ((double) mix->input_max - mix->input_min) - 1.0);
+}
+
+
+
+// Copy the channels picked out by -C from a decoded frame into the interleaved `samples`
+// buffer, or mix them down into floats. Input channels nothing uses are never touched.
+static void append_mixed_frame(AudioData *data, AVFrame *pFrame, int is_planar) {
+    ChannelMix *mix = data->mix;
+    int size = mix->input_sample_size;
+    int i;
+    int c;
+    int k;
+
+    for (i = 0; i < pFrame->nb_samples; ++i) {
+        for (c = 0; c < mix->outputs; ++c) {
+            if (mix->source) {
+                // just a selection. Copy the sample over as it is.
+                k = mix->source[c];
+
+                memcpy(data->samples + data->size, is_planar ?
+                       pFrame->extended_data[k] + i * size :
+                       pFrame->extended_data[0] + (i * mix->inputs + k) * size, size);
+            } else {
+                float value = 0.0f;
+
+                for (k = 0; k < mix->inputs; ++k) {
+                    float weight = mix->weights[c * mix->inputs + k];
+
+                    if (weight != 0.0f) {
+                        value += weight * read_mix_input(mix, is_planar ?
+                                 pFrame->extended_data[k] + i * size :
+                                 pFrame->extended_data[0] + (i * mix->inputs + k) * size);
+                    }
+                }
+
+                memcpy(data->samples + data->size, &value, sizeof(float));
+            }
+
+            data->size += data->sample_size;
+        }
+    }
+}
+
+
+
+/*
+ * Copy the raw samples of a decoded frame onto the end of the given track's `samples`
+ * buffer (or just count them if `populate_sample_buffer` is 0), interleaving them if needed.
+ * Returns 0 if the buffer couldn't be grown to fit them.
+ */
+static int append_frame(AudioData *data, AVFrame *pFrame, int populate_sample_buffer) {
+    // is the audio interleaved or planar?
+    int is_planar = av_sample_fmt_is_planar(data->decoder_context->sample_fmt);
+
+    // Find the size of all pFrame->extended_data in bytes. Remember, this will be:
+    // data_size = pFrame->nb_samples * pFrame->channels * bytes_per_sample
+    int data_size = av_samples_get_buffer_size(
+        is_planar ? &pFrame->linesize[0] : NULL,
+        data->mix ? data->mix->inputs : data->channels,
+        pFrame->nb_samples,
+        data->decoder_context->sample_fmt,
+        1
+    );
+
+    // how much of that ends up in the `samples` buffer. All of it, unless channels are being
+    // picked out or mixed (-C).
+    int append_size = data->mix ? pFrame->nb_samples * data->channels * data->sample_size : data_size;
+
+    if (data->sample_rate == 0) {
+        data->sample_rate = pFrame->sample_rate;
+    }
+
+    // if we don't have enough space in our copy buffer, expand it by at least a quarter, so
+    // a small first guess doesn't mean growing it again for every frame
+    if (populate_sample_buffer && data->size + append_size > data->allocated_size) {
+        int allocated_size = data->allocated_size + data->allocated_size / 4 + 1;
+
+        if (allocated_size < data->size + append_size) {
+            allocated_size = data->size + append_size;
+        }
+
+        uint8_t *samples = realloc(data->samples, allocated_size);
+
+        if (samples == NULL) {
+            return 0;
+        }
+
+        data->samples = samples;
+        data->allocated_size = allocated_size;
+    }
+
+    if (data->mix) {
+        if (populate_sample_buffer) {
+            append_mixed_frame(data, pFrame, is_planar);
+        } else {
+            data->size += append_size;
+        }
+    } else if (is_planar) {
+        // normalize all planes into the interleaved sample buffer
+        int i = 0;
+        int c = 0;
+
+        // data_size is total data overall for all planes.
+        // iterate through extended_data and copy each sample into `samples` while
+        // interleaving each channel (copy sample one from left, then right. copy sample
+        // two from left, then right, etc.)
+        for (; i < data_size / data->channels; i += data->sample_size) {
+            for (c = 0; c < data->channels; c++) {
+                if (populate_sample_buffer) {
+                    memcpy(data->samples + data->size, pFrame->extended_data[c] + i, data->sample_size);
+                }
+
+                data->size += data->sample_size;
+            }
+        }
+    } else {
+        // source file is already interleaved. just copy the raw data from the frame into
+        // the `samples` buffer.
+        if (populate_sample_buffer) {
+            memcpy(data->samples + data->size, pFrame->extended_data[0], data_size);
+        }
+
+        data->size += data_size;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Report what the program is up to on the -p file descriptor as a single line of JSON, such as
+ *
+ *     {"stage":"decode","input":0,"bytes":1048576,"time":12.5,"duration":300.0,"progress":0.0417,"elapsed":0.8}
+ *
+ * `pStage` is one of open, cached (the input was found in the -K cache), decode, render,
+ * write, done or cancelled. The fields describing the input (bytes demuxed so far, seconds of
+ * audio decoded so far, duration according to the container, and how far along decoding is
+ * from 0 to 1) are only there if `data` is given, and are null when they aren't known. `elapsed` is seconds since the program started.
+ *
+ * Each report goes out in one write, so reports from different threads don't get mixed up.
+ */
+static void report_progress(const char *pStage, AudioData *data) {
+    char line[512];
+    int length;
+
+    if (progress_fd < 0) {
+        return;
+    }
+
+    double elapsed = (av_gettime() - progress_start_time) / 1000000.0;
+
+    if (data == NULL) {
+        length = snprintf(line, sizeof(line), "{\"stage\":\"%s\",\"elapsed\":%.3f}\n", pStage, elapsed);
+    } else {
+        AVFormatContext *pFormatContext = data->format_context;
+        int64_t bytes = pFormatContext->pb ? pFormatContext->pb->bytes_read : 0;
+        int64_t input_size = pFormatContext->pb ? avio_size(pFormatContext->pb) : 0;
+        char duration[32] = "null";
+        char progress[32] = "null";
+        double time = 0.0;
+
+        // everything decoded so far is in the samples of the first track
+        if (data->sample_rate > 0) {
+            time = (double) data->size / data->sample_size / data->channels / data->sample_rate;
+        }
+
+        if (pFormatContext->duration != AV_NOPTS_VALUE && pFormatContext->duration > 0) {
+            double total = pFormatContext->duration / (double) AV_TIME_BASE;
+
+            snprintf(duration, sizeof(duration), "%.3f", total);
+            snprintf(progress, sizeof(progress), "%.4f", time < total ? time / total : 1.0);
+        } else if (input_size > 0) {
+            // no idea how long the audio is, but we know how much of the file is left
+            snprintf(progress, sizeof(progress), "%.4f", bytes < input_size ? (double) bytes / input_size : 1.0);
+        }
+
+        length = snprintf(line, sizeof(line),
+            "{\"stage\":\"%s\",\"input\":%i,\"bytes\":%lli,\"time\":%.3f,\"duration\":%s,"
+            "\"progress\":%s,\"elapsed\":%.3f}\n",
+            pStage, data->input_index, (long long) bytes, time, duration, progress, elapsed);
+    }
+
+    if (length > 0 && length < (int) sizeof(line)) {
+        // progress is best effort. If whoever is listening went away, carry on without them
+        if (write(progress_fd, line, length) < 0) {
+            progress_fd = -1;
+        }
+    }
+}
+
+
+
+/*
+ * Iterate through the audio file, converting all compressed samples into raw samples.
+ * This will populate all of the fields on the data struct, with the exception of
+ * the `samples` buffer if `populate_sample_buffer` is set to 0
+ *
+ * Every track chained to `data` through `next` is filled in during the same pass over
+ * the file.
+ */
+static void read_raw_audio_data(AudioData *data, int populate_sample_buffer) {
+    // Packets will contain chucks of compressed audio data read from the audio file.
+    AVPacket packet;
+
+    // Frames will contain the raw uncompressed audio data read from a packet
+    AVFrame *pFrame = NULL;
+
+    // how long in seconds is the audio file?
+    double duration = data->format_context->duration / (double) AV_TIME_BASE;
+
+    // the track a packet belongs to
+    AudioData *track = NULL;
+
+    int64_t start_time = av_gettime();
+
+    // when decoding progress should be reported next
+    int64_t next_report = start_time + PROGRESS_INTERVAL;
+
+    // set if the samples don't fit in memory, which ends the read
+    int out_of_memory = 0;
+
+    av_init_packet(&packet);
+
+    if (!(pFrame = av_frame_alloc())) {
+        // leave `data->size` at 0 so the caller knows nothing was read
+        fprintf(stderr, "Could not allocate AVFrame\n");
+        return;
+    }
+
+    for (track = data; track != NULL; track = track->next) {
+        // running total of how much data has been converted to raw and copied into the
+        // `samples` buffer.
+        track->size = 0;
+        track->sample_rate = 0;
+        track->allocated_size = 0;
+
+        // guess how much memory we'll need for samples. Inputs that aren't seekable (like stdin)
+        // usually have no idea how long they are, so just start with something reasonable and
+        // let the buffer grow.
+        if (populate_sample_buffer) {
+            if (duration > 0 && track->decoder_context->bit_rate > 0) {
+                track->allocated_size = (track->decoder_context->bit_rate / 8) * duration;
+            } else if (duration > 0 && data->format_context->bit_rate > 0) {
+                track->allocated_size = (data->format_context->bit_rate / 8) * duration;
+            }
+
+            if (track->allocated_size <= 0) {
+                track->allocated_size = DEFAULT_SAMPLE_BUFFER_SIZE;
+            }
+
+            track->samples = malloc(sizeof(uint8_t) * track->allocated_size);
+
+            // start from nothing and let `append_frame` grow it instead
+            if (track->samples == NULL) {
+                track->allocated_size = 0;
+            }
+        }
+    }
+
+    // Loop through the entire audio file by reading a compressed packet of the stream
+    // into the uncomrpressed frame struct and copy it into a buffer.
+    // It's important to remember that in this context, even though the actual format might
+    // be 16 bit or 24 bit or float with x number of channels, while we're copying things,
+    // we are only dealing with an array of 8 bit integers. 
+    //
+    // It's up to anything using the AudioData struct to know how to properly read the data
+    // inside `samples`
+    //
+    // If the program gets cancelled, stop reading and leave what's been read so far. The
+    // caller is expected to check `cancelled` and throw it away.
+    while (!cancelled && av_read_frame(data->format_context, &packet) == 0) {
+        // some audio formats might not contain an entire raw frame in a single compressed packet.
+        // If this is the case, then decode_audio4 will tell us that it didn't get all of the
+        // raw frame via this out argument.
+        int frame_finished = 0;
+
+        // find the track this packet belongs to. Packets from any other stream (video,
+        // subtitles, audio tracks we weren't asked for) get thrown away.
+        for (track = data; track != NULL && track->stream_index != packet.stream_index; track = track->next);
+
+        // Use the decoder to populate the raw frame with data from the compressed packet.
+        // If the packet can't be decoded, just move on to the next one.
+        if (track != NULL &&
+                avcodec_decode_audio4(track->decoder_context, pFrame, &frame_finished, &packet) >= 0 &&
+                frame_finished) {
+            // we got an entire raw frame from the packet
+            if (!append_frame(track, pFrame, populate_sample_buffer)) {
+                fprintf(stderr, "ERROR: Out of memory reading the samples of stream %i\n",
+                        track->stream_index);
+                out_of_memory = 1;
+                av_free_packet(&packet);
+                break;
+            }
+        }
+
+        // Packets must be freed, otherwise you'll have a fix a hole where the rain gets in
+        // (and keep your mind from wandering...)
+        av_free_packet(&packet);
+
+        if (progress_fd >= 0 && av_gettime() >= next_report) {
+            report_progress("decode", data);
+            next_report = av_gettime() + PROGRESS_INTERVAL;
+        }
+    }
+
+    av_frame_free(&pFrame);
+
+    if (out_of_memory) {
+        // whatever was read is incomplete, so leave every track looking like nothing could be
+        // read at all
+        for (track = data; track != NULL; track = track->next) {
+            free(track->samples);
+            track->samples = NULL;
+            track->size = 0;
+        }
+    }
+
+    data->stats.read_time = (av_gettime() - start_time) / 1000000.0;
+    data->stats.bytes_read = data->format_context->pb ? data->format_context->pb->bytes_read : 0;
+
+    for (track = data; track != NULL; track = track->next) {
+        if (track->size == 0) {
+            // not a single packet could be read.
+            continue;
+        }
+
+        track->duration = (track->size * 8.0) /
+            (track->sample_rate * track->sample_size * 8.0 * track->channels);
+    }
+
+    if (!cancelled) {
+        report_progress("decode", data);
+    }
+}
+
+
+
+/*
+ * Take the given AudioData struct and convert all the compressed data
+ * into the raw interleaved sample buffer.
+ *
+ * This function also calculates and populates the metadata information from
+ * `read_audio_metadata`.
+ */
+void read_audio_data(AudioData *data) {
+    read_raw_audio_data(data, 1);
+}
+
+
+
+
+/*
+ * Take the given AudioData struct and calculate all of the properties
+ * without doing any of the memory operations on the raw sample data.
+ *
+ * This is so we can get accurate metadata about the file (which we can't
+ * really do for all formats unless we look at the raw data underneith, hence
+ * why somethings ffmpeg isn't entirely accurate with duration via ffprobe)
+ * without the overhead of image drawing.
+ *
+ * NOTE: data->samples will still not be valid after calling this function.
+ * If you care about this information but also want data->samples to be
+ * populated, use `read_audio_data` instead
+ */
+void read_audio_metadata(AudioData *data) {
+    read_raw_audio_data(data, 0);
+}
+
+
+
+/*
+ * Interrupt callback for ffmpeg's own I/O, so it stops waiting on the input once the program
+ * is cancelled
+ */
+static int check_cancelled(void *opaque) {
+    return cancelled;
+}
+
+
+
+/*
+ * AudioReadCallback that reads from stdin. Used when the input file is given as `-`.
+ */
+static int read_stdin(void *opaque, uint8_t *buf, int buf_size) {
+    ssize_t bytes_read;
+
+    do {
+        bytes_read = read(STDIN_FILENO, buf, buf_size);
+    } while (bytes_read < 0 && errno == EINTR && !cancelled);
+
+    if (cancelled) {
+        // a signal interrupted the read to cancel the program. Don't wait for more input.
+        return AVERROR_EXIT;
+    }
+
+    if (bytes_read < 0) {
+        return AVERROR(errno);
+    }
+
+    return bytes_read == 0 ? AVERROR_EOF : (int) bytes_read;
+}
+
+
+
+/*
+ * Check if the container header told ffmpeg enough about the audio stream that will be
+ * decoded (every audio stream with -a) to start decoding without having to probe the streams
+ * with avformat_find_stream_info. That includes the sample format, and a duration, which the
+ * sample buffer size and the progress reports are worked out from.
+ */
+static int has_audio_parameters(AVFormatContext *pFormatContext) {
+    int stream_index = -1;
+    int audio_streams = 0;
+    unsigned int i;
+
+    if (!read_all_tracks) {
+        stream_index = av_find_best_stream(pFormatContext, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+        if (stream_index < 0) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < pFormatContext->nb_streams; ++i) {
+        AVStream *pStream = pFormatContext->streams[i];
+        AVCodecContext *pCodecContext = pStream->codec;
+
+        if (pCodecContext->codec_type != AVMEDIA_TYPE_AUDIO ||
+                (stream_index >= 0 && (int) i != stream_index)) {
+            continue;
+        }
+
+        if (pCodecContext->codec_id == AV_CODEC_ID_NONE ||
+                pCodecContext->sample_rate <= 0 ||
+                pCodecContext->channels <= 0 ||
+                pCodecContext->sample_fmt == AV_SAMPLE_FMT_NONE ||
+                (pFormatContext->duration <= 0 && pStream->duration <= 0)) {
+            return 0;
+        }
+
+        ++audio_streams;
+    }
+
+    return audio_streams > 0;
+}
+
+
+
+/*
+ * Work out which channel of a track with the given channel layout a channel of -C refers to:
+ * an index counting from 0, an ffmpeg channel name (FL, FR, FC, LFE, BL, BR, SL, SR...), or
+ * L, R or C for FL, FR and FC. Returns -1 if the track doesn't have that channel.
+ */
+static int get_channel_index(const char *pName, uint64_t layout, int channels) {
+    char *pEnd = NULL;
+    long index = strtol(pName, &pEnd, 10);
+
+    if (pEnd != pName && *pEnd == '\0') {
+        return index >= 0 && index < channels ? (int) index : -1;
+    }
+
+    if (strcmp(pName, "L") == 0) {
+        pName = "FL";
+    } else if (strcmp(pName, "R") == 0) {
+        pName = "FR";
+    } else if (strcmp(pName, "C") == 0) {
+        pName = "FC";
+    }
+
+    uint64_t channel = av_get_channel_layout(pName);
+
+    // has to be the name of a single channel, not a whole layout like "stereo"
+    if (channel == 0 || (channel & (channel - 1)) != 0) {
+        return -1;
+    }
+
+    index = av_get_channel_layout_channel_index(layout, channel);
+
+    return index >= 0 && index < channels ? (int) index : -1;
+}
+
+
+
+/*
+ * Set up the channel selection or mix given to -C for the given track, and change the
+ * track's channels (and format, if channels get mixed) to what ends up in its `samples`.
+ *
+ * `pSpec` is a comma separated list of output channels. Each is a channel of the track, or
+ * several joined by + which get averaged. A channel can be given a weight with W*, as in
+ * 0.7*C, which is used instead of averaging. Returns 0 if `pSpec` doesn't work for the track.
+ */
+static int apply_channel_mix(AudioData *data, const char *pSpec) {
+    uint64_t layout = data->decoder_context->channel_layout;
+    ChannelMix *mix = calloc(1, sizeof(ChannelMix));
+    char *pCopy = strdup(pSpec);
+    char *pOutputState = NULL;
+    char *pOutput;
+    const char *p;
+    int mixing = 0;
+    int o = 0;
+
+    if (mix == NULL || pCopy == NULL) {
+        goto ERROR;
+    }
+
+    // plenty of files don't say which channel is which, so assume ffmpeg's usual order
+    if (layout == 0) {
+        layout = av_get_default_channel_layout(data->channels);
+    }
+
+    mix->inputs = data->channels;
+    mix->input_format = data->format;
+    mix->input_sample_size = data->sample_size;
+    get_format_range(data->format, &mix->input_min, &mix->input_max);
+
+    for (mix->outputs = 1, p = pSpec; *p; ++p) {
+        mix->outputs += *p == ',';
+    }
+
+    mix->source = malloc(sizeof(int) * mix->outputs);
+    mix->weights = calloc(mix->outputs * mix->inputs, sizeof(float));
+
+    if (mix->source == NULL || mix->weights == NULL) {
+        goto ERROR;
+    }
+
+    for (pOutput = strtok_r(pCopy, ",", &pOutputState); pOutput != NULL && o < mix->outputs;
+            pOutput = strtok_r(NULL, ",", &pOutputState), ++o) {
+        char *pTermState = NULL;
+        char *pTerm;
+        int terms = 1;
+
+        // strtok_r would quietly skip the empty terms of L+, +R or L++R, and leave the
+        // weights of the terms it did find off
+        if (pOutput[0] == '+' || pOutput[strlen(pOutput) - 1] == '+' || strstr(pOutput, "++")) {
+            fprintf(stderr, "Cannot make sense of -C %s.\n", pSpec);
+            goto ERROR;
+        }
+
+        for (p = pOutput; *p; ++p) {
+            terms += *p == '+';
+        }
+
+        // averaging several channels (or weighing any) means the samples have to be mixed
+        if (terms > 1) {
+            mixing = 1;
+        }
+
+        for (pTerm = strtok_r(pOutput, "+", &pTermState); pTerm != NULL;
+                pTerm = strtok_r(NULL, "+", &pTermState)) {
+            float weight = 1.0f / terms;
+            char *pName = pTerm;
+            char *pEnd = NULL;
+            double given_weight = strtod(pTerm, &pEnd);
+
+            if (pEnd != pTerm && *pEnd == '*') {
+                weight = (float) given_weight;
+                pName = pEnd + 1;
+                mixing = 1;
+            }
+
+            int index = get_channel_index(pName, layout, mix->inputs);
+
+            if (index < 0) {
+                fprintf(stderr, "Audio stream %i has no channel %s.\n", data->stream_index, pName);
+                goto ERROR;
+            }
+
+            mix->weights[o * mix->inputs + index] += weight;
+            mix->source[o] = index;
+        }
+    }
+
+    if (o != mix->outputs) {
+        fprintf(stderr, "Cannot make sense of -C %s.\n", pSpec);
+        goto ERROR;
+    }
+
+    if (mixing) {
+        free(mix->source);
+        mix->source = NULL;
+
+        data->format = SAMPLE_FORMAT_FLOAT;
+        data->sample_size = sizeof(float);
+    } else {
+        free(mix->weights);
+        mix->weights = NULL;
+    }
+
+    data->channels = mix->outputs;
+    data->mix = mix;
+
+    free(pCopy);
+    return 1;
+
+ERROR:
+    free(pCopy);
+    free_channel_mix(mix);
+    return 0;
+}
+
+
+
+/*
+ * Open a decoder for the given audio stream of an opened input and wrap it in an AudioData
+ * struct. If `pDecoder` is NULL, the decoder is looked up from the stream's codec id.
+ *
+ * Returns NULL if the stream isn't audio or can't be decoded.
+ */
+static AudioData *open_audio_track(AVFormatContext *pFormatContext, int stream_index, AVCodec *pDecoder) {
+    // Container for the stream's codec
+    AVCodecContext *pDecoderContext = pFormatContext->streams[stream_index]->codec;
+    AudioData *data = NULL;
+
+    if (pDecoderContext->codec_type != AVMEDIA_TYPE_AUDIO) {
+        return NULL;
+    }
+
+    if (pDecoder == NULL && (pDecoder = avcodec_find_decoder(pDecoderContext->codec_id)) == NULL) {
+        fprintf(stderr, "No decoder for audio stream %i.\n", stream_index);
+        return NULL;
+    }
+
+    // open the decoder for this audio stream
+    if (avcodec_open2(pDecoderContext, pDecoder, NULL) < 0) {
+        fprintf(stderr, "Cannot open audio decoder for stream %i.\n", stream_index);
+        return NULL;
+    }
+
+    data = create_audio_data_struct(pFormatContext, pDecoderContext);
+
+    if (data == NULL) {
+        avcodec_close(pDecoderContext);
+        return NULL;
+    }
+
+    data->stream_index = stream_index;
+
+    if (channel_mix_spec && !apply_channel_mix(data, channel_mix_spec)) {
+        // the decoder isn't ours to free until the track is in the chain
+        avcodec_close(pDecoderContext);
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+
+
+/*
+ * Open the given input, find the audio stream we care about, open a decoder for it, and
+ * wrap it all up in an AudioData struct.
+ *
+ * If `pIOContext` is given, ffmpeg reads through it instead of opening `pFilePath` itself
+ * (`pFilePath` is then only used as a hint for guessing the container format). Ownership of
+ * `pIOContext` passes to this function: it is freed along with the returned AudioData, or
+ * right away if the input can't be opened.
+ *
+ * Returns NULL if the input can't be read.
+ */
+static AudioData *open_audio(const char *pFilePath, AVIOContext *pIOContext) {
+    AVFormatContext *pFormatContext = NULL; // Container for the audio file
+    AVCodec *pDecoder = NULL; // actual codec for the stream
+    AVDictionary *pOptions = NULL; // options for opening the input
+    AudioData *data = NULL;
+    int stream_index = 0; // which audio stream should be looked at
+    int probed = 0; // did we have to probe the streams with avformat_find_stream_info?
+    int64_t start_time = av_gettime();
+    unsigned int i;
+
+    // We could be fed any number of types of audio containers with any number of
+    // encodings. These functions tell ffmpeg to load every library it knows about.
+    // This way we don't need to explicity tell ffmpeg which libraries to load.
+    // (both of these only do anything the first time they are called)
+    //
+    // Register all availible muxers/demuxers/protocols. We could be fed anything.
+    av_register_all();
+
+    // register all codecs/parsers/bitstream-filters
+    avcodec_register_all();
+
+    // The format context needs to exist before it is opened so we can tell it to give up on
+    // whatever it's blocked on once the program is cancelled, and so we can hand it the
+    // AVIOContext when reading through our own I/O.
+    if (!(pFormatContext = avformat_alloc_context())) {
+        fprintf(stderr, "Could not allocate AVFormatContext\n");
+        goto ERROR;
+    }
+
+    pFormatContext->interrupt_callback.callback = check_cancelled;
+
+    if (pIOContext) {
+        pFormatContext->pb = pIOContext;
+    }
+
+    if (fast_start) {
+        // keep ffmpeg from reading more than a little bit of the file when it probes
+        av_dict_set(&pOptions, "probesize", FAST_PROBE_SIZE, 0);
+        av_dict_set(&pOptions, "analyzeduration", FAST_ANALYZE_DURATION, 0);
+    }
+
+    // open the audio file
+    if (avformat_open_input(&pFormatContext, pFilePath, NULL, &pOptions) < 0) {
+        fprintf(stderr, "Cannot open input file.\n");
+        av_dict_free(&pOptions);
+        goto ERROR;
+    }
+
+    av_dict_free(&pOptions);
+
+    if (fast_start) {
+        // tell the demuxer not to bother with anything that isn't audio, both while probing
+        // and while reading
+        for (i = 0; i < pFormatContext->nb_streams; ++i) {
+            if (pFormatContext->streams[i]->codec->codec_type != AVMEDIA_TYPE_AUDIO) {
+                pFormatContext->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+    }
+
+    // Tell ffmpeg to read the file header and scan some of the data to determine
+    // everything it can about the format of the file. Plenty of containers (wav, flac,
+    // mov, mkv...) already say everything we need to know about the audio in their
+    // header, so in fast start mode we skip this when we can.
+    if (!fast_start || !has_audio_parameters(pFormatContext)) {
+        if (avformat_find_stream_info(pFormatContext, NULL) < 0) {
+            fprintf(stderr, "Cannot find stream information.\n");
+            goto ERROR;
+        }
+
+        probed = 1;
+    } else if (pFormatContext->duration <= 0) {
+        // the header only gave the length of the audio streams. Probing would have worked out
+        // the length of the whole file from them, so do the same.
+        for (i = 0; i < pFormatContext->nb_streams; ++i) {
+            AVStream *pStream = pFormatContext->streams[i];
+
+            if (pStream->codec->codec_type == AVMEDIA_TYPE_AUDIO && pStream->duration > 0) {
+                int64_t duration = av_rescale_q(pStream->duration, pStream->time_base,
+                                                AV_TIME_BASE_Q);
+
+                if (duration > pFormatContext->duration) {
+                    pFormatContext->duration = duration;
+                }
+            }
+        }
+    }
+
+    // find the audio stream we probably care about.
+    // For audio files, there will most likely be only one stream.
+    stream_index = av_find_best_stream(pFormatContext, AVMEDIA_TYPE_AUDIO, -1, -1, &pDecoder, 0);
+
+    if (stream_index < 0) {
+        fprintf(stderr, "Unable to find audio stream in file.\n");
+        goto ERROR;
+    }
+
+    if (read_all_tracks) {
+        // open a decoder for every audio stream in the file, in the order they appear.
+        // The first one becomes the head of the chain and owns the format context.
+        AudioData *last = NULL;
+
+        for (i = 0; i < pFormatContext->nb_streams; ++i) {
+            AudioData *track = open_audio_track(pFormatContext, i, NULL);
+
+            if (track == NULL) {
+                continue;
+            }
+
+            if (last == NULL) {
+                data = track;
+            } else {
+                last->next = track;
+            }
+
+            last = track;
+        }
+    } else {
+        data = open_audio_track(pFormatContext, stream_index, pDecoder);
+    }
+
+    if (data == NULL) {
+        goto ERROR;
+    }
+
+    // we won't do anything with the packets of streams that aren't being decoded, so let the
+    // demuxer skip over them instead of reading them in
+    for (i = 0; i < pFormatContext->nb_streams; ++i) {
+        AudioData *track = data;
+
+        for (; track != NULL && track->stream_index != (int) i; track = track->next);
+
+        if (track == NULL) {
+            pFormatContext->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    data->io_context = pIOContext;
+
+    data->stats.open_time = (av_gettime() - start_time) / 1000000.0;
+    data->stats.probed = probed;
+
+    if (pFormatContext->pb) {
+        data->stats.probe_bytes = pFormatContext->pb->bytes_read;
+        data->stats.input_size = avio_size(pFormatContext->pb);
+    }
+
+    return data;
+
+ERROR:
+    // avformat_open_input frees the format context on failure, so there may be nothing to close
+    if (pFormatContext) {
+        avformat_close_input(&pFormatContext);
+    }
+
+    free_io_context(pIOContext);
+
+    return NULL;
+}
+
+
+
+/*
+ * Open the audio file at the given path. Returns NULL if it can't be read.
+ */
+AudioData *open_audio_file(const char *pFilePath) {
+    return open_audio(pFilePath, NULL);
+}
+
+
+
+/*
+ * Open an audio file that is read through the given callback as it arrives, such as a pipe
+ * or a network upload. The input is treated as non-seekable, so containers that need to seek
+ * (mp4 files with the index at the end, for instance) may not be readable this way.
+ *
+ * `opaque` is handed to every call of `read_packet` and still belongs to the caller.
+ * Returns NULL if the input can't be read.
+ */
+AudioData *open_audio_stream(AudioReadCallback read_packet, void *opaque) {
+    unsigned char *pIOBuffer = av_malloc(AVIO_BUFFER_SIZE);
+    AVIOContext *pIOContext = NULL;
+
+    if (!pIOBuffer) {
+        return NULL;
+    }
+
+    pIOContext = avio_alloc_context(pIOBuffer, AVIO_BUFFER_SIZE, 0, opaque, read_packet, NULL, NULL);
+
+    if (!pIOContext) {
+        av_free(pIOBuffer);
+        return NULL;
+    }
+
+    pIOContext->seekable = 0;
+
+    return open_audio("", pIOContext);
+}
+
+
+
+/*
+ * Takes an incomming 32 bit unsigned integer representing an RGBa hex color
+ * and converts it to a png_byte color
+ */
+static void read_color(uint32_t hex, png_byte *color) {
+    color[0] = (hex >> 24) & 0xFF; // red
+    color[1] = (hex >> 16) & 0xFF; // green
+    color[2] = (hex >> 8) & 0xFF; // blue
+    color[3] = hex & 0xFF;  // alpha
+}
+
+
+
+/*
+ * Open the audio file at the given path, or stdin if the path is `-`
+ */
+static AudioData *open_audio_path(const char *pFilePath) {
+    if (strcmp(pFilePath, "-") == 0) {
+        return open_audio_stream(read_stdin, NULL);
+    }
+
+    return open_audio_file(pFilePath);
+}
+
+
+
+/*
+ * Lock manager for ffmpeg, so codecs can be opened from more than one thread at once
+ * (playlists)
+ */
+static int lock_manager(void **mutex, enum AVLockOp op) {
+    switch (op) {
+        case AV_LOCK_CREATE:
+            *mutex = malloc(sizeof(pthread_mutex_t));
+
+            if (*mutex == NULL) {
+                return 1;
+            }
+
+            return pthread_mutex_init((pthread_mutex_t *) *mutex, NULL) != 0;
+        case AV_LOCK_OBTAIN:
+            return pthread_mutex_lock((pthread_mutex_t *) *mutex) != 0;
+        case AV_LOCK_RELEASE:
+            return pthread_mutex_unlock((pthread_mutex_t *) *mutex) != 0;
+        case AV_LOCK_DESTROY:
+            pthread_mutex_destroy((pthread_mutex_t *) *mutex);
+            free(*mutex);
+            *mutex = NULL;
+            return 0;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Parse the SIZE[:HOP] argument of the -S option into `spectrogram_size` and
+ * `spectrogram_hop`. The size is set to -1 if it isn't a usable FFT size.
+ */
+static void read_spectrogram_size(const char *arg) {
+    char *pEnd = NULL;
+
+    spectrogram_size = strtol(arg, &pEnd, 10);
+
+    if (*pEnd == ':') {
+        spectrogram_hop = atol(pEnd + 1);
+    }
+
+    // has to be a power of two for the FFT
+    if (spectrogram_size < 16 || (spectrogram_size & (spectrogram_size - 1)) != 0) {
+        spectrogram_size = -1;
+    }
+}
+
+
+
+/*
+ * Print out how much time and I/O it took to read the given audio data, so the effect of
+ * options like -f can be measured.
+ */
+static void print_stats(AudioData *data) {
+    AudioStats *stats = &data->stats;
+
+    printf("    %-*s: %f seconds (%s)\n", 15, "Open time", stats->open_time,
+           stats->probed ? "probed streams" : "header only");
+    printf("    %-*s: %f seconds\n", 15, "Read time", stats->read_time);
+    printf("    %-*s: %lli bytes\n", 15, "Probe read", (long long) stats->probe_bytes);
+
+    if (stats->input_size > 0) {
+        printf("    %-*s: %lli of %lli bytes (%.1f%%)\n", 15, "Total read",
+               (long long) stats->bytes_read, (long long) stats->input_size,
+               stats->bytes_read * 100.0 / stats->input_size);
+    } else {
+        printf("    %-*s: %lli bytes\n", 15, "Total read", (long long) stats->bytes_read);
+    }
+}
+
+
+
+/*
+ * Parse the FD argument of the -p option into `progress_fd`. Returns 0 if it isn't a
+ * file descriptor number.
+ */
+static int read_progress_fd(const char *arg) {
+    char *pEnd = NULL;
+    long fd = strtol(arg, &pEnd, 10);
+
+    if (pEnd == arg || *pEnd != '\0' || fd < 0 || fd > INT_MAX) {
+        return 0;
+    }
+
+    progress_fd = (int) fd;
+
+    return 1;
+}
+
+
+
+/*
+ * Parse the DB[:SECONDS] argument of the -s option into `silence_level` and
+ * `silence_duration`. Returns 0 if it doesn't make sense.
+ */
+static int read_silence_threshold(const char *arg) {
+    char *pEnd = NULL;
+    double db = strtod(arg, &pEnd);
+
+    if (*pEnd == ':') {
+        silence_duration = atof(pEnd + 1);
+    }
+
+    silence_level = pow(10.0, db / 20.0);
+
+    return pEnd != arg && db <= 0.0 && silence_duration > 0.0;
+}
+
+
+
+/*
+ * Write a list of spans to the span report as an array of start and end times in seconds
+ */
+static void write_span_list(SpanList *list, int sample_rate) {
+    int i;
+
+    fprintf(span_report, "[");
+
+    for (i = 0; i < list->count; ++i) {
+        fprintf(span_report, "%s{\"start\":%.6f,\"end\":%.6f}", i > 0 ? "," : "",
+                (double) list->start[i] / sample_rate, (double) list->end[i] / sample_rate);
+    }
+
+    fprintf(span_report, "]");
+}
+
+
+
+/*
+ * Add the silent and clipped spans found while making the given summary of the given audio
+ * track to the span report (-r), if there is one
+ */
+static void write_span_report(AudioData *data, WaveformSummary *summary) {
+    int c;
+
+    if (span_report == NULL || summary == NULL || summary->spans == NULL) {
+        return;
+    }
+
+    fprintf(span_report, "%s  {\"input\":%i,\"stream\":%i,\"duration\":%.6f,\"channels\":[\n",
+            span_report_count++ > 0 ? ",\n" : "", data->input_index, data->stream_index,
+            data->duration);
+
+    for (c = 0; c < summary->span_channels; ++c) {
+        fprintf(span_report, "    {\"channel\":%i,\"silence\":", c);
+        write_span_list(&summary->spans[c].silence, data->sample_rate);
+        fprintf(span_report, ",\"clipping\":");
+        write_span_list(&summary->spans[c].clipping, data->sample_rate);
+        fprintf(span_report, "}%s\n", c + 1 < summary->span_channels ? "," : "");
+    }
+
+    fprintf(span_report, "  ]}");
+}
+
+
+
+/*
+ * Look for silent and clipped spans in every track of the given audio and add them to the
+ * span report (-r). Only needed when nothing else reduces the samples of the tracks (-d, -S).
+ */
+static void report_spans(AudioData *data, int track_count) {
+    AudioData *track = data;
+    int i;
+
+    if (span_report == NULL) {
+        return;
+    }
+
+    for (i = 0; i < track_count && track != NULL && !cancelled; ++i, track = track->next) {
+        // a single column is all it takes to scan every sample
+        WaveformSummary *summary = summarize_waveform(track, 1);
+
+        write_span_report(track, summary);
+        free_summary(summary);
+    }
+}
+
+
+
+/*
+ * Open the span report (-r) at the given path, or return 0 if it can't be written
+ */
+static int open_span_report(const char *pPath) {
+    if (!(span_report = fopen(pPath, "w"))) {
+        return 0;
+    }
+
+    fprintf(span_report, "[\n");
+
+    return 1;
+}
+
+
+
+/*
+ * Finish and close the span report (-r), if there is one
+ */
+static void close_span_report() {
+    if (span_report == NULL) {
+        return;
+    }
+
+    fprintf(span_report, "%s]\n", span_report_count > 0 ? "\n" : "");
+    fclose(span_report);
+    span_report = NULL;
+}
+
+
+
+/*
+ * Figure out how tall the image should be given the -h (`height`) and -t (`track_height`)
+ * options and how many waveforms are stacked in it.
+ */
+static int get_image_height(int band_count, int height, int track_height) {
+    // if there is both a height and track_height and track height * bands will fit within
+    // height OR there is no height:
+    if ((track_height > 0 && height > 0 && track_height * band_count < height) || height <= 0) {
+        // set the image height equal to track_height * bands
+        height = track_height * band_count;
+    }
+
+    return height;
+}
+
+
+
+/*
+ * Print out the metadata of every track of the given audio data (-d), followed by the stats
+ * of reading it
+ */
+static void print_metadata(AudioData *data) {
+    AudioData *track = data;
+
+    for (; track != NULL; track = track->next) {
+        if (read_all_tracks) {
+            printf("    %-*s: %i\n", 15, "Stream", track->stream_index);
+        }
+
+        printf("    %-*s: %f seconds\n", 15, "Duration", track->duration);
+        printf("    %-*s: %s\n", 15, "Compression", track->decoder_context->codec->name);
+        printf("    %-*s: %i Hz\n", 15, "Sample rate", track->sample_rate);
+        printf("    %-*s: %i\n", 15, "Channels", track->channels);
+        printf("    %-*s: %i b/s\n", 15, "Bit rate", data->format_context->bit_rate);
+    }
+
+    print_stats(data);
+}
+
+
+
+/*
+ * Parse the DIR[:MB] argument of the -K option into `cache_dir` and `cache_size_limit`.
+ * Returns 0 if it doesn't make sense.
+ */
+static int read_cache_option(const char *arg) {
+    const char *pSize = strrchr(arg, ':');
+    size_t length = pSize ? (size_t) (pSize - arg) : strlen(arg);
+
+    if (pSize) {
+        cache_size_limit = (int64_t) (atof(pSize + 1) * 1024 * 1024);
+    }
+
+    // lives as long as the program does
+    cache_dir = strndup(arg, length);
+
+    return length > 0 && cache_size_limit > 0;
+}
+
+
+
+/*
+ * Check if the cache (-K) can stand in for decoding the given input. It can't for stdin, or
+ * when the samples themselves are needed (-S, -r).
+ */
+static int can_use_cache(const char *pFilePath) {
+    return cache_dir != NULL && strcmp(pFilePath, "-") != 0 && spectrogram_size == 0 &&
+        span_report == NULL;
+}
+
+
+
+/*
+ * Work out the key of the cache entry for the given file and where the entry lives. The key
+ * is everything that changes what would be stored: which file it is (its real path, size
+ * and modification time, down to the nanosecond where the file system keeps it) and the
+ * options that change the summaries. Returns 0 if the file can't be looked at.
+ *
+ * The entry's file name is a hash of the key, and the key itself is kept in the file, so two
+ * keys that happen to hash the same are told apart when the entry is read.
+ */
+static int get_cache_entry(const char *pFilePath, int monofy, char *pKey, size_t key_size,
+                           char *pEntryPath, size_t entry_path_size
+) {
+    char pRealPath[PATH_MAX];
+    struct stat file_stat;
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    const char *p;
+
+    if (stat(pFilePath, &file_stat) != 0 || realpath(pFilePath, pRealPath) == NULL) {
+        return 0;
+    }
+
+    int length = snprintf(pKey, key_size, "%s\n%lli\n%lli.%09li\n%i %i %i %i\n%s\n", pRealPath,
+                          (long long) file_stat.st_size, (long long) file_stat.st_mtime,
+                          (long) MTIME_NSEC(file_stat),
+                          read_all_tracks, monofy, band_colors, FINE_SUMMARY_BIN_SIZE,
+                          channel_mix_spec ? channel_mix_spec : "");
+
+    if (length < 0 || (size_t) length >= key_size) {
+        return 0;
+    }
+
+    for (p = pKey; *p; ++p) {
+        hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+    }
+
+    length = snprintf(pEntryPath, entry_path_size, "%s/%016llx.wfc", cache_dir,
+                      (unsigned long long) hash);
+
+    return length > 0 && (size_t) length < entry_path_size;
+}
+
+
+
+/*
+ * Check that the header of a track in a cache entry (stream index, sample rate, channels,
+ * columns and summary channels) and its duration describe a summary `get_fine_summary` could
+ * have made, before anything is allocated for it. A damaged entry can still have the right
+ * key, and its column and channel counts must not be trusted to size anything.
+ */
+static int check_cache_track(const int32_t *header, double duration, int monofy) {
+    double samples = duration * header[1];
+
+    if (header[1] <= 0 || header[2] <= 0 || !(duration > 0.0) || samples > INT_MAX) {
+        return 0;
+    }
+
+    // -m summaries have a single channel, others one for every channel of the audio
+    if (header[4] != (monofy ? 1 : header[2])) {
+        return 0;
+    }
+
+    return header[3] >= 1 && header[3] <= samples / FINE_SUMMARY_BIN_SIZE + 1 &&
+        (int64_t) header[3] * header[4] * 3 <= INT_MAX;
+}
+
+
+
+/*
+ * Read the cached summaries of every track of the given file (-K). Returns the tracks as
+ * AudioData structs that only have their metadata and `summary` filled in, or NULL if the
+ * file isn't in the cache.
+ *
+ * Reading an entry marks it as recently used, so it's among the last to be thrown out.
+ */
+static AudioData *read_cache(const char *pFilePath, int monofy) {
+    char pKey[PATH_MAX + 256];
+    char pStoredKey[PATH_MAX + 256];
+    char pEntryPath[PATH_MAX];
+    char magic[4];
+    AudioData *data = NULL;
+    AudioData *last = NULL;
+    uint32_t key_length = 0;
+    int32_t track_count = 0;
+    int i;
+
+    if (!get_cache_entry(pFilePath, monofy, pKey, sizeof(pKey), pEntryPath, sizeof(pEntryPath))) {
+        return NULL;
+    }
+
+    FILE *pFile = fopen(pEntryPath, "rb");
+
+    if (pFile == NULL) {
+        return NULL;
+    }
+
+    if (fread(magic, 1, 4, pFile) != 4 || memcmp(magic, CACHE_MAGIC, 4) != 0 ||
+            fread(&key_length, sizeof(key_length), 1, pFile) != 1 ||
+            key_length != strlen(pKey) ||
+            fread(pStoredKey, 1, key_length, pFile) != key_length ||
+            memcmp(pStoredKey, pKey, key_length) != 0 ||
+            fread(&track_count, sizeof(track_count), 1, pFile) != 1) {
+        goto ERROR;
+    }
+
+    for (i = 0; i < track_count; ++i) {
+        int32_t header[5]; // stream index, sample rate, channels, columns, summary channels
+        AudioData *track = calloc(1, sizeof(AudioData));
+
+        if (track == NULL) {
+            goto ERROR;
+        }
+
+        if (last == NULL) {
+            data = track;
+        } else {
+            last->next = track;
+        }
+
+        last = track;
+
+        if (fread(header, sizeof(int32_t), 5, pFile) != 5 ||
+                fread(&track->duration, sizeof(double), 1, pFile) != 1 ||
+                !check_cache_track(header, track->duration, monofy) ||
+                !(track->summary = create_summary(header[3], header[4]))) {
+            goto ERROR;
+        }
+
+        WaveformSummary *summary = track->summary;
+        size_t values = (size_t) summary->columns * summary->channels;
+
+        track->stream_index = header[0];
+        track->sample_rate = header[1];
+        track->channels = header[2];
+        track->input_index = 0;
+
+        if (fread(summary->min, sizeof(double), values, pFile) != values ||
+                fread(summary->max, sizeof(double), values, pFile) != values ||
+                (summary->energy && fread(summary->energy, sizeof(float), values * 3, pFile) != values * 3)) {
+            goto ERROR;
+        }
+    }
+
+    fclose(pFile);
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    // touch the entry so eviction sees it was just used
+    utimes(pEntryPath, NULL);
+
+    return data;
+
+ERROR:
+    // a broken or foreign entry is no worse than a miss. It gets replaced when the file is
+    // decoded again.
+    fclose(pFile);
+
+    if (data) {
+        free_audio_data(data);
+    }
+
+    return NULL;
+}
+
+
+
+// a file in the cache directory, for `evict_cache`
+typedef struct CacheFile {
+    char *pPath;
+    int64_t size;
+    time_t last_used;
+} CacheFile;
+
+// qsort comparator putting the least recently used cache files first
+static int compare_cache_files(const void *a, const void *b) {
+    const CacheFile *x = (const CacheFile *) a;
+    const CacheFile *y = (const CacheFile *) b;
+
+    return (x->last_used > y->last_used) - (x->last_used < y->last_used);
+}
+
+
+
+/*
+ * Throw out the least recently used entries of the cache until it fits in
+ * `cache_size_limit`. Other processes may be doing the same at the same time, so entries
+ * that are already gone are not a problem.
+ */
+static void evict_cache() {
+    DIR *pDir = opendir(cache_dir);
+    CacheFile *files = NULL;
+    struct dirent *pEntry;
+    int64_t total_size = 0;
+    int count = 0;
+    int allocated = 0;
+    int i;
+
+    if (pDir == NULL) {
+        return;
+    }
+
+    while ((pEntry = readdir(pDir)) != NULL) {
+        size_t length = strlen(pEntry->d_name);
+        char pPath[PATH_MAX];
+        struct stat file_stat;
+
+        // only look at finished entries, not files other processes are still writing
+        if (length < 4 || strcmp(pEntry->d_name + length - 4, ".wfc") != 0 ||
+                pEntry->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(pPath, sizeof(pPath), "%s/%s", cache_dir, pEntry->d_name);
+
+        if (stat(pPath, &file_stat) != 0) {
+            continue;
+        }
+
+        if (count == allocated) {
+            CacheFile *more = realloc(files, sizeof(CacheFile) * (allocated ? allocated * 2 : 64));
+
+            if (more == NULL) {
+                break;
+            }
+
+            files = more;
+            allocated = allocated ? allocated * 2 : 64;
+        }
+
+        files[count].pPath = strdup(pPath);
+        files[count].size = file_stat.st_size;
+        files[count].last_used = file_stat.st_mtime;
+        total_size += file_stat.st_size;
+        ++count;
+    }
+
+    closedir(pDir);
+
+    if (total_size > cache_size_limit) {
+        qsort(files, count, sizeof(CacheFile), compare_cache_files);
+
+        for (i = 0; i < count && total_size > cache_size_limit; ++i) {
+            if (files[i].pPath && unlink(files[i].pPath) == 0) {
+                total_size -= files[i].size;
+            }
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        free(files[i].pPath);
+    }
+
+    free(files);
+}
+
+
+
+/*
+ * Store the summaries of every track of the given file (the `summary` of each track in the
+ * chain) in the cache (-K). The entry is written to a temporary file first and renamed into
+ * place, so other processes reading the cache at the same time either see all of it or
+ * none of it. Afterwards, old entries are thrown out if the cache has grown too big.
+ */
+static void write_cache(const char *pFilePath, AudioData *data, int monofy) {
+    char pKey[PATH_MAX + 256];
+    char pEntryPath[PATH_MAX];
+    char pTempPath[PATH_MAX];
+    AudioData *track;
+    int32_t track_count = 0;
+    int ok = 1;
+
+    for (track = data; track != NULL; track = track->next) {
+        if (track->summary == NULL) {
+            return;
+        }
+
+        ++track_count;
+    }
+
+    if (!get_cache_entry(pFilePath, monofy, pKey, sizeof(pKey), pEntryPath, sizeof(pEntryPath))) {
+        return;
+    }
+
+    // start with a dot, so `evict_cache` leaves it alone
+    snprintf(pTempPath, sizeof(pTempPath), "%s/.wfc.XXXXXX", cache_dir);
+
+    int fd = mkstemp(pTempPath);
+
+    if (fd < 0) {
+        fprintf(stderr, "WARNING: Cannot write to cache directory %s\n", cache_dir);
+        return;
+    }
+
+    FILE *pFile = fdopen(fd, "wb");
+
+    if (pFile == NULL) {
+        close(fd);
+        unlink(pTempPath);
+        return;
+    }
+
+    uint32_t key_length = strlen(pKey);
+
+    ok = fwrite(CACHE_MAGIC, 1, 4, pFile) == 4 &&
+        fwrite(&key_length, sizeof(key_length), 1, pFile) == 1 &&
+        fwrite(pKey, 1, key_length, pFile) == key_length &&
+        fwrite(&track_count, sizeof(track_count), 1, pFile) == 1;
+
+    for (track = data; ok && track != NULL; track = track->next) {
+        WaveformSummary *summary = track->summary;
+        size_t values = (size_t) summary->columns * summary->channels;
+        int32_t header[5] = {
+            track->stream_index, track->sample_rate, track->channels, summary->columns,
+            summary->channels
+        };
+
+        ok = fwrite(header, sizeof(int32_t), 5, pFile) == 5 &&
+            fwrite(&track->duration, sizeof(double), 1, pFile) == 1 &&
+            fwrite(summary->min, sizeof(double), values, pFile) == values &&
+            fwrite(summary->max, sizeof(double), values, pFile) == values &&
+            (!summary->energy || fwrite(summary->energy, sizeof(float), values * 3, pFile) == values * 3);
+    }
+
+    // a cancelled summary is only partly filled in, so it must not end up in the cache
+    if (fclose(pFile) != 0 || !ok || cancelled || rename(pTempPath, pEntryPath) != 0) {
+        unlink(pTempPath);
+        return;
+    }
+
+    evict_cache();
+}
+
+
+
+/*
+ * Reduce every track of the given decoded file to the fine grained summary kept in the
+ * cache (-K), store them in the cache, and throw the samples away. The images are then drawn
+ * from the summaries, just like they would be had the file been in the cache, so an image
+ * comes out the same either way.
+ */
+static void cache_audio_data(const char *pFilePath, AudioData *data, int monofy) {
+    AudioData *track;
+
+    // an entry has to hold every track, so files with a track that couldn't be decoded
+    // aren't cached
+    for (track = data; track != NULL; track = track->next) {
+        if (is_empty_track(track)) {
+            return;
+        }
+    }
+
+    for (track = data; track != NULL; track = track->next) {
+        if (!(track->summary = get_fine_summary(track, monofy))) {
+            return;
+        }
+    }
+
+    write_cache(pFilePath, data, monofy);
+
+    for (track = data; track != NULL; track = track->next) {
+        free(track->samples);
+        track->samples = NULL;
+    }
+}
+
+
+
+/*
+ * Draw the waveforms of `track_count` tracks, starting at `data` and following the `next`
+ * chain, stacked on top of each other in a single png written to `pOutFile` (or stdout).
+ *
+ * `height` and `track_height` follow the rules of the -h and -t options, where every channel
+ * of every track (or every track, if `monofy` is set) counts as one track of the image.
+ *
+ * Returns 0, or 2 if the program was cancelled before the image was written, in which case
+ * the unfinished output file is removed.
+ */
+static int render_tracks(AudioData *data, int track_count, const char *pOutFile,
+                          int width, int height, int track_height, int monofy
+) {
+    AudioData *track = data;
+    int band_count = 0; // how many individual waveforms will be drawn in the image
+    int i;
+
+    for (i = 0; i < track_count; ++i, track = track->next) {
+        if (!is_empty_track(track)) {
+            band_count += monofy ? 1 : track->channels;
+        }
+    }
+
+    height = get_image_height(band_count, height, track_height);
+
+    report_progress("render", NULL);
+
+    // init the png struct so we can start drawing
+    WaveformPNG png = init_png(pOutFile, width, height);
+
+    // give every track a slice of the image proportional to how many waveforms it has.
+    // The drawing functions only know about the rows they're handed, so each track gets
+    // drawn onto a copy of the png struct that starts at the top of its slice.
+    int bands_drawn = 0;
+    int start_y = 0;
+
+    for (i = 0, track = data; i < track_count; ++i, track = track->next) {
+        WaveformPNG slice = png;
+
+        // tracks nothing could be decoded from get no space in the image
+        if (is_empty_track(track)) {
+            continue;
+        }
+
+        bands_drawn += monofy ? 1 : track->channels;
+
+        int end_y = (int) ((double) height * bands_drawn / band_count);
+
+        slice.pRows = png.pRows + start_y;
+        slice.height = end_y - start_y;
+
+        if (spectrogram_size > 0) {
+            draw_spectrogram(&slice, track, monofy);
+            report_spans(track, 1);
+        } else {
+            WaveformSummary *summary = NULL;
+
+            if (track->summary) {
+                // the track has already been reduced to a fine grained summary for the
+                // cache (-K), which only needs to be shrunk down to the image
+                summary = resize_summary(track->summary, width);
+            } else if (monofy) {
+                // if specified, reduce all channels into a single waveform
+                summary = summarize_combined_waveform(track, width);
+            } else {
+                // otherwise, draw them all stacked individually
+                summary = summarize_waveform(track, width);
+            }
+
+            if (summary && monofy) {
+                draw_combined_waveform(&slice, summary);
+            } else if (summary) {
+                draw_waveform(&slice, summary);
+            }
+
+            write_span_report(track, summary);
+            free_summary(summary);
+        }
+
+        start_y = end_y;
+    }
+
+    if (cancelled) {
+        // nothing has been written yet, so there's no half drawn image to show for it
+        close_png(&png);
+
+        if (pOutFile) {
+            unlink(pOutFile);
+        }
+
+        return 2;
+    }
+
+    report_progress("write", NULL);
+
+    write_png(&png);
+    close_png(&png);
+
+    return 0;
+}
+
+
+
+/*
+ * ParallelTask reading one file of a playlist. The file is decoded and reduced to a fine
+ * grained summary, and its samples are thrown away so only the summaries of all files need
+ * to be kept around at once.
  */
-AudioData *create_audio_data_struct(AVFormatContext *pFormatContext, AVCodecContext *pDecoderContext) {
-    // Make the AudioData object we'll be returning
-    AudioData *data = malloc(sizeof(AudioData));
-    data->format_context = pFormatContext;
-    data->decoder_context = pDecoderContext;
-    data->format = pDecoderContext->sample_fmt;
-    data->sample_size = (int) av_get_bytes_per_sample(pDecoderContext->sample_fmt); // *byte* depth
-    data->channels = pDecoderContext->channels;
-    data->samples = NULL;
+static void read_playlist_entry(void *context, int block) {
+    Playlist *playlist = (Playlist *) context;
+    PlaylistEntry *entry = &playlist->entries[block];
+    int use_cache = !playlist->metadata && can_use_cache(entry->pFilePath);
+    AudioData *data = NULL;
+
+    // the cache holds exactly the summary the file would be reduced to here
+    if (use_cache && (data = entry->data = read_cache(entry->pFilePath, playlist->monofy))) {
+        data->input_index = block;
+        entry->summary = data->summary;
+        data->summary = NULL;
+        report_progress("cached", NULL);
+        return;
+    }
 
-    // normalize the sample format to an enum that's less verbose than AVSampleFormat.
-    // We won't care about planar/interleaved
-    switch (pDecoderContext->sample_fmt) {
-        case AV_SAMPLE_FMT_U8:
-        case AV_SAMPLE_FMT_U8P:
-            data->format = SAMPLE_FORMAT_UINT8;
-            break;
-        case AV_SAMPLE_FMT_S16:
-        case AV_SAMPLE_FMT_S16P:
-            data->format = SAMPLE_FORMAT_INT16;
-            break;
-        case AV_SAMPLE_FMT_S32:
-        case AV_SAMPLE_FMT_S32P:
-            data->format = SAMPLE_FORMAT_INT32;
-            break;
-        case AV_SAMPLE_FMT_FLT:
-        case AV_SAMPLE_FMT_FLTP:
-            data->format = SAMPLE_FORMAT_FLOAT;
-            break;
-        case AV_SAMPLE_FMT_DBL:
-        case AV_SAMPLE_FMT_DBLP:
-            data->format = SAMPLE_FORMAT_DOUBLE;
-            break;
-        default:
-            fprintf(stderr, "Bad format: %s\n", av_get_sample_fmt_name(pDecoderContext->sample_fmt));
-            free_audio_data(data);
-            return NULL;
+    data = entry->data = open_audio_path(entry->pFilePath);
+
+    if (data == NULL) {
+        return;
     }
 
-    return data;
+    data->input_index = block;
+    report_progress("open", data);
+
+    // the samples are needed after all if silence and clipping are being looked for (-r)
+    if (playlist->metadata && span_report == NULL) {
+        read_audio_metadata(data);
+        return;
+    }
+
+    read_audio_data(data);
+
+    if (data->size == 0 || cancelled) {
+        return;
+    }
+
+    entry->summary = get_fine_summary(data, playlist->monofy);
+
+    if (use_cache && entry->summary) {
+        // the summary stays the entry's, it's only lent to the track to be written out
+        data->summary = entry->summary;
+        write_cache(entry->pFilePath, data, playlist->monofy);
+        data->summary = NULL;
+    }
+
+    free(data->samples);
+    data->samples = NULL;
 }
 
 
 
 /*
- * Iterate through the audio file, converting all compressed samples into raw samples.
- * This will populate all of the fields on the data struct, with the exception of
- * the `samples` buffer if `populate_sample_buffer` is set to 0
+ * Draw one waveform of several files laid end to end (multiple -i), each taking up a part
+ * of the width proportional to its duration. Files are decoded at the same time, spread
+ * across threads (-j). With `metadata` set, print the metadata of each file instead.
+ *
+ * If the files don't all have the same number of channels, each file's channels are merged
+ * into a single waveform. Returns the exit code for the program (2 if it was cancelled).
  */
-static void read_raw_audio_data(AudioData *data, int populate_sample_buffer) {
-    // Packets will contain chucks of compressed audio data read from the audio file.
-    AVPacket packet;
+static int render_playlist(const char **pFilePaths, int count, const char *pOutFile, int width,
+                           int height, int track_height, int monofy, int metadata
+) {
+    Playlist playlist;
+    WaveformSummary *summary = NULL;
+    double total_duration = 0.0;
+    int channels = 0;
+    int merge_channels = 0;
+    int result = 1;
+    int i;
+
+    playlist.entries = calloc(count, sizeof(PlaylistEntry));
+    playlist.count = count;
+    playlist.metadata = metadata;
+    playlist.monofy = monofy;
+
+    if (playlist.entries == NULL) {
+        return 1;
+    }
 
-    // Frames will contain the raw uncompressed audio data read from a packet
-    AVFrame *pFrame = NULL;
+    for (i = 0; i < count; ++i) {
+        playlist.entries[i].pFilePath = pFilePaths[i];
+    }
 
-    // how long in seconds is the audio file?
-    double duration = data->format_context->duration / (double) AV_TIME_BASE;
-    int raw_sample_rate = 0;
+    // get ffmpeg set up before any threads touch it, and make opening codecs thread safe
+    av_register_all();
+    avcodec_register_all();
 
-    // is the audio interleaved or planar?
-    int is_planar = av_sample_fmt_is_planar(data->decoder_context->sample_fmt);
+    if (av_lockmgr_register(lock_manager) != 0) {
+        fprintf(stderr, "Cannot register ffmpeg lock manager.\n");
+        goto END;
+    }
 
-    // running total of how much data has been converted to raw and copied into the AudioData
-    // `samples` buffer. This will eventually be `data->size`
-    int total_size = 0;
+    run_parallel(read_playlist_entry, &playlist, count);
 
-    av_init_packet(&packet);
+    if (cancelled) {
+        result = 2;
+        goto END;
+    }
 
-    if (!(pFrame = av_frame_alloc())) {
-        fprintf(stderr, "Could not allocate AVFrame\n");
-        free_audio_data(data);
-        return;
+    for (i = 0; i < count; ++i) {
+        PlaylistEntry *entry = &playlist.entries[i];
+
+        if (entry->data == NULL || ((!metadata || span_report) && entry->summary == NULL)) {
+            fprintf(stderr, "Cannot read %s.\n", entry->pFilePath);
+            goto END;
+        }
+
+        write_span_report(entry->data, entry->summary);
+
+        total_duration += entry->data->duration;
+
+        if (channels == 0) {
+            channels = entry->summary ? entry->summary->channels : entry->data->channels;
+        } else if (entry->summary && entry->summary->channels != channels) {
+            merge_channels = 1;
+        }
     }
 
-    int allocated_buffer_size = 0;
+    if (metadata) {
+        for (i = 0; i < count; ++i) {
+            printf("%s\n", playlist.entries[i].pFilePath);
+            print_metadata(playlist.entries[i].data);
+        }
+
+        printf("Total\n");
+        printf("    %-*s: %f seconds\n", 15, "Duration", total_duration);
 
-    // guess how much memory we'll need for samples.
-    if (populate_sample_buffer) {
-        allocated_buffer_size = (data->format_context->bit_rate / 8) * duration;
-        data->samples = malloc(sizeof(uint8_t) * allocated_buffer_size);
+        result = 0;
+        goto END;
     }
 
-    // Loop through the entire audio file by reading a compressed packet of the stream
-    // into the uncomrpressed frame struct and copy it into a buffer.
-    // It's important to remember that in this context, even though the actual format might
-    // be 16 bit or 24 bit or float with x number of channels, while we're copying things,
-    // we are only dealing with an array of 8 bit integers. 
-    //
-    // It's up to anything using the AudioData struct to know how to properly read the data
-    // inside `samples`
-    while (av_read_frame(data->format_context, &packet) == 0) {
-        // some audio formats might not contain an entire raw frame in a single compressed packet.
-        // If this is the case, then decode_audio4 will tell us that it didn't get all of the
-        // raw frame via this out argument.
-        int frame_finished = 0;
+    if (merge_channels) {
+        fprintf(stderr, "WARNING: Files have different channel counts. Merging channels.\n");
+        channels = 1;
+    }
 
-        // Use the decoder to populate the raw frame with data from the compressed packet.
-        if (avcodec_decode_audio4(data->decoder_context, pFrame, &frame_finished, &packet) < 0) {
-            // unable to decode this packet. continue on to the next packet
+    if (total_duration <= 0.0 || !(summary = create_summary(width, channels))) {
+        goto END;
+    }
+
+    // give each file a number of columns proportional to its duration, and shrink its summary
+    // down to that many columns in its spot of the combined summary
+    double elapsed = 0.0;
+    int start_x = 0;
+
+    for (i = 0; i < count; ++i) {
+        PlaylistEntry *entry = &playlist.entries[i];
+        WaveformSummary *source = entry->summary;
+        WaveformSummary *merged = NULL;
+        WaveformSummary *part = NULL;
+        int c;
+
+        elapsed += entry->data->duration;
+
+        int end_x = (int) floor(width * elapsed / total_duration + 0.5);
+        int columns = end_x - start_x;
+
+        if (columns <= 0) {
             continue;
         }
 
-        // did we get an entire raw frame from the packet?
-        if (frame_finished) {
-            // Find the size of all pFrame->extended_data in bytes. Remember, this will be:
-            // data_size = pFrame->nb_samples * pFrame->channels * bytes_per_sample
-            int data_size = av_samples_get_buffer_size(
-                is_planar ? &pFrame->linesize[0] : NULL,
-                data->channels,
-                pFrame->nb_samples,
-                data->decoder_context->sample_fmt,
-                1
-            );
-
-            if (raw_sample_rate == 0) {
-                raw_sample_rate = pFrame->sample_rate;
-            }
-
-            // if we don't have enough space in our copy buffer, expand it
-            if (populate_sample_buffer && total_size + data_size > allocated_buffer_size) {
-                allocated_buffer_size = allocated_buffer_size * 1.25;
-                data->samples = realloc(data->samples, allocated_buffer_size);
-            }
-
-            if (is_planar) {
-                // normalize all planes into the interleaved sample buffer
-                int i = 0;
-                int c = 0;
-
-                // data_size is total data overall for all planes.
-                // iterate through extended_data and copy each sample into `samples` while
-                // interleaving each channel (copy sample one from left, then right. copy sample
-                // two from left, then right, etc.)
-                for (; i < data_size / data->channels; i += data->sample_size) {
-                    for (c = 0; c < data->channels; c++) {
-                        if (populate_sample_buffer) {
-                            memcpy(data->samples + total_size, pFrame->extended_data[c] + i, data->sample_size);
-                        }
+        if (merge_channels && source->channels > 1) {
+            source = merged = merge_summary_channels(source);
+        }
 
-                        total_size += data->sample_size;
-                    }
-                }
-            } else {
-                // source file is already interleaved. just copy the raw data from the frame into
-                // the `samples` buffer.
-                if (populate_sample_buffer) {
-                    memcpy(data->samples + total_size, pFrame->extended_data[0], data_size);
-                }
+        if (source == NULL || !(part = resize_summary(source, columns))) {
+            free_summary(merged);
+            goto END;
+        }
 
-                total_size += data_size;
+        for (c = 0; c < channels; ++c) {
+            memcpy(&summary->min[c * width + start_x], &part->min[c * columns], sizeof(double) * columns);
+            memcpy(&summary->max[c * width + start_x], &part->max[c * columns], sizeof(double) * columns);
+
+            if (summary->energy && part->energy) {
+                memcpy(&summary->energy[(c * width + start_x) * 3], &part->energy[c * columns * 3],
+                       sizeof(float) * columns * 3);
             }
         }
 
-        // Packets must be freed, otherwise you'll have a fix a hole where the rain gets in
-        // (and keep your mind from wandering...)
-        av_free_packet(&packet);
+        free_summary(part);
+        free_summary(merged);
+
+        start_x = end_x;
     }
 
-    data->size = total_size;
-    data->sample_rate = raw_sample_rate;
+    report_progress("render", NULL);
 
-    av_frame_free(&pFrame);
+    // init the png struct so we can start drawing
+    WaveformPNG png = init_png(pOutFile, width, get_image_height(channels, height, track_height));
 
-    if (total_size == 0) {
-        // not a single packet could be read.
-        return;
+    if (monofy || merge_channels) {
+        draw_combined_waveform(&png, summary);
+    } else {
+        draw_waveform(&png, summary);
     }
 
-    data->duration = (data->size * 8.0) / (raw_sample_rate * data->sample_size * 8.0 * data->channels);
-}
+    if (cancelled) {
+        // the blocks that weren't drawn are uninitialized memory, so don't write any of it
+        close_png(&png);
 
+        if (pOutFile) {
+            unlink(pOutFile);
+        }
 
+        result = 2;
+        goto END;
+    }
 
-/*
- * Take the given AudioData struct and convert all the compressed data
- * into the raw interleaved sample buffer.
- *
- * This function also calculates and populates the metadata information from
- * `read_audio_metadata`.
- */
-void read_audio_data(AudioData *data) {
-    read_raw_audio_data(data, 1);
-}
+    report_progress("write", NULL);
 
+    write_png(&png);
+    close_png(&png);
 
+    result = 0;
 
+END:
+    for (i = 0; i < count; ++i) {
+        if (playlist.entries[i].data) {
+            free_audio_data(playlist.entries[i].data);
+        }
 
-/*
- * Take the given AudioData struct and calculate all of the properties
- * without doing any of the memory operations on the raw sample data.
- *
- * This is so we can get accurate metadata about the file (which we can't
- * really do for all formats unless we look at the raw data underneith, hence
- * why somethings ffmpeg isn't entirely accurate with duration via ffprobe)
- * without the overhead of image drawing.
- *
- * NOTE: data->samples will still not be valid after calling this function.
- * If you care about this information but also want data->samples to be
- * populated, use `read_audio_data` instead
- */
-void read_audio_metadata(AudioData *data) {
-    read_raw_audio_data(data, 0);
+        free_summary(playlist.entries[i].summary);
+    }
+
+    free_summary(summary);
+    free(playlist.entries);
+    av_lockmgr_register(NULL);
+
+    return result;
 }
 
 
 
 /*
- * Takes an incomming 32 bit unsigned integer representing an RGBa hex color
- * and converts it to a png_byte color
+ * Signal handler that cancels the program (SIGINT, SIGTERM, or SIGALRM once the -T deadline
+ * is up). Every stage checks `cancelled` and winds down on its own.
  */
-static void read_color(uint32_t hex, png_byte *color) {
-    color[0] = (hex >> 24) & 0xFF; // red
-    color[1] = (hex >> 16) & 0xFF; // green
-    color[2] = (hex >> 8) & 0xFF; // blue
-    color[3] = hex & 0xFF;  // alpha
+static void cancel_program(int signal) {
+    cancelled = 1;
 }
 
 
@@ -797,7 +4532,14 @@ int main(int argc, char *argv[]) {
     int monofy = 0; // should we reduce everything into one waveform
     int metadata = 0; // should we just spit out metadata and not draw an image
     const char *pFilePath = NULL; // audio input file path
+    const char **pFilePaths = NULL; // every audio input file path, when there's more than one
+    int file_count = 0;
     const char *pOutFile = NULL; // image output file path. `NULL` means stdout
+    int deadline = 0; // seconds the program is allowed to run before it cancels itself
+    const char *pSpanReportFile = NULL; // where to write silent and clipped spans
+    struct sigaction cancel_action;
+
+    progress_start_time = av_gettime();
 
     if (argc < 1) {
         help();
@@ -805,15 +4547,46 @@ int main(int argc, char *argv[]) {
 
     // command line arg parsing
     int c;
-    while ((c = getopt(argc, argv, "c:b:i:o:dmw:h:t:")) != -1) {
+    while ((c = getopt(argc, argv, "aBC:c:b:i:o:dfg:j:K:lmp:r:s:S:T:w:h:t:")) != -1) {
         switch (c) {
+            case 'a': read_all_tracks = 1; break;
+            case 'B': band_colors = 1; break;
             case 'b': read_color(strtol(optarg, NULL, 16), &color_bg[0]); break;
+            case 'C': channel_mix_spec = optarg; break;
             case 'c': read_color(strtol(optarg, NULL, 16), &color_waveform[0]); break;
             case 'd': metadata = 1; break;
+            case 'f': fast_start = 1; break;
+            case 'g': auto_gain = strcmp(optarg, "peak") == 0 ? 100.0 : atof(optarg); break;
             case 'h': height = atol(optarg); break;
-            case 'i': pFilePath = optarg; break;
+            case 'i':
+                pFilePaths = realloc(pFilePaths, sizeof(char *) * (file_count + 1));
+                pFilePaths[file_count++] = pFilePath = optarg;
+                break;
+            case 'j': thread_count = atol(optarg); break;
+            case 'K':
+                if (!read_cache_option(optarg)) {
+                    fprintf(stderr, "ERROR: -K must be a directory, optionally followed by :MB above 0\n");
+                    help();
+                }
+                break;
+            case 'l': log_scale = 1; break;
             case 'm': monofy = 1; break;
             case 'o': pOutFile = optarg; break;
+            case 'p':
+                if (!read_progress_fd(optarg)) {
+                    fprintf(stderr, "ERROR: -p must be a file descriptor number\n");
+                    help();
+                }
+                break;
+            case 'r': pSpanReportFile = optarg; break;
+            case 's':
+                if (!read_silence_threshold(optarg)) {
+                    fprintf(stderr, "ERROR: -s must be a level of at most 0 dB and a duration above 0\n");
+                    help();
+                }
+                break;
+            case 'S': read_spectrogram_size(optarg); break;
+            case 'T': deadline = atol(optarg); break;
             case 't': track_height = atol(optarg); break;
             case 'w': width = atol(optarg); break;
             default:
@@ -827,108 +4600,200 @@ int main(int argc, char *argv[]) {
         help();
     }
 
+    if (file_count > 1 && (read_all_tracks || spectrogram_size)) {
+        fprintf(stderr, "ERROR: -a and -S can't be used with more than one input file\n");
+        help();
+    }
+
+    if (auto_gain < 0.0 || auto_gain > 100.0) {
+        fprintf(stderr, "ERROR: -g must be peak or a percentile between 0 and 100\n");
+        help();
+    }
+
+    if (spectrogram_size < 0) {
+        fprintf(stderr, "ERROR: The FFT size of -S must be a power of two of at least 16\n");
+        help();
+    }
+
+    if (progress_fd == STDOUT_FILENO && !pOutFile) {
+        fprintf(stderr, "ERROR: -p can't report to stdout while the image goes there, use -o\n");
+        help();
+    }
+
     // if no height or track_height was specified, default to track_height=64
     if (height < 0 && track_height < 0) {
         track_height = 64;
     }
 
-    // We could be fed any number of types of audio containers with any number of
-    // encodings. These functions tell ffmpeg to load every library it knows about.
-    // This way we don't need to explicity tell ffmpeg which libraries to load.
-    //
-    // Register all availible muxers/demuxers/protocols. We could be fed anything.
-    av_register_all(); 
+    // Catch the signals used to stop a job, so we get to free everything and remove the
+    // unfinished image instead of dying halfway through. Without SA_RESTART, a signal also
+    // interrupts whatever read the program is blocked on (writes of the image carry on, see
+    // `write_png_data`).
+    memset(&cancel_action, 0, sizeof(cancel_action));
+    cancel_action.sa_handler = cancel_program;
+    sigemptyset(&cancel_action.sa_mask);
+    sigaction(SIGINT, &cancel_action, NULL);
+    sigaction(SIGTERM, &cancel_action, NULL);
+    sigaction(SIGALRM, &cancel_action, NULL);
+
+    // if whoever reads the -p reports goes away, the write fails with EPIPE and reporting
+    // stops (see `report_progress`), instead of the signal killing the program halfway
+    signal(SIGPIPE, SIG_IGN);
+
+    if (deadline > 0) {
+        alarm(deadline);
+    }
 
-    // register all codecs/parsers/bitstream-filters
-    avcodec_register_all();
+    if (pSpanReportFile && !open_span_report(pSpanReportFile)) {
+        fprintf(stderr, "ERROR: Cannot write %s\n", pSpanReportFile);
+        return 1;
+    }
 
-    AVFormatContext *pFormatContext = NULL; // Container for the audio file
-    AVCodecContext *pDecoderContext = NULL; // Container for the stream's codec
-    AVCodec *pDecoder = NULL; // actual codec for the stream
-    int stream_index = 0; // which audio stream should be looked at
+    if (file_count > 1) {
+        // playlist
+        int result = render_playlist(pFilePaths, file_count, pOutFile, width, height, track_height,
+                                     monofy, metadata);
 
-    // open the audio file
-    if (avformat_open_input(&pFormatContext, pFilePath, NULL, NULL) < 0) {
-        fprintf(stderr, "Cannot open input file.\n");
-        goto ERROR;
-    }
+        free(pFilePaths);
+        close_span_report();
 
-    // Tell ffmpeg to read the file header and scan some of the data to determine
-    // everything it can about the format of the file
-    if (avformat_find_stream_info(pFormatContext, NULL) < 0) {
-        fprintf(stderr, "Cannot find stream information.\n");
-        goto ERROR;
-    }
+        if (result == 2) {
+            fprintf(stderr, "Cancelled.\n");
+            report_progress("cancelled", NULL);
 
-    // find the audio stream we probably care about.
-    // For audio files, there will most likely be only one stream.
-    stream_index = av_find_best_stream(pFormatContext, AVMEDIA_TYPE_AUDIO, -1, -1, &pDecoder, 0);
+            if (pSpanReportFile) {
+                unlink(pSpanReportFile);
+            }
+        } else if (result == 0) {
+            report_progress("done", NULL);
+        }
 
-    if (stream_index < 0) {
-        fprintf(stderr, "Unable to find audio stream in file.\n");
-        goto ERROR;
+        return result;
     }
 
-    // now that we have a stream, get the codec for the given stream
-    pDecoderContext = pFormatContext->streams[stream_index]->codec;
+    free(pFilePaths);
 
-    // open the decoder for this audio stream
-    if (avcodec_open2(pDecoderContext, pDecoder, NULL) < 0) {
-        fprintf(stderr, "Cannot open audio decoder.\n");
-        goto ERROR;
-    }
+    AudioData *data = NULL;
+    int use_cache = !metadata && can_use_cache(pFilePath);
+
+    if (use_cache && (data = read_cache(pFilePath, monofy))) {
+        // the file doesn't even need to be opened
+        report_progress("cached", NULL);
+    } else {
+        // `-` means the audio is being piped in through stdin
+        data = open_audio_path(pFilePath);
 
-    AudioData *data = create_audio_data_struct(pFormatContext, pDecoderContext);
+        if (data == NULL) {
+            if (cancelled) {
+                goto CANCELLED;
+            }
 
-    if (data == NULL) {
-        goto ERROR;
+            close_span_report();
+            return 1;
+        }
+
+        report_progress("open", data);
     }
 
-    if (metadata) {
+    if (metadata && span_report) {
+        // the samples are needed to look for silence and clipping, but there's nothing to
+        // draw
+        read_audio_data(data);
+
+        if (cancelled) {
+            goto CANCELLED;
+        }
+
+        report_spans(data, INT_MAX);
+        print_metadata(data);
+    } else if (metadata) {
         // only fetch metadata about the file.
         read_audio_metadata(data);
 
-        printf("    %-*s: %f seconds\n", 15, "Duration", data->duration);
-        printf("    %-*s: %s\n", 15, "Compression", pDecoderContext->codec->name);
-        printf("    %-*s: %i Hz\n", 15, "Sample rate", data->sample_rate);
-        printf("    %-*s: %i\n", 15, "Channels", data->channels);
-        printf("    %-*s: %i b/s\n", 15, "Bit rate", pFormatContext->bit_rate);
+        if (cancelled) {
+            goto CANCELLED;
+        }
+
+        print_metadata(data);
     } else {
-        // fetch the raw data and the metadata
-        read_audio_data(data);
+        // fetch the raw data and the metadata, unless it came out of the cache
+        if (data->summary == NULL) {
+            read_audio_data(data);
 
-        if (data->size == 0) {
-            goto ERROR;
+            if (cancelled) {
+                goto CANCELLED;
+            }
         }
 
-        // if there is both a height and track_height and track height * channels will fit within
-        // height OR there is no height and we are not monofying:
-        if ((track_height > 0 && height > 0 && track_height * data->channels < height) ||
-                (height <= 0 && !monofy)) {
-            // set the image height equal to track_height * channels
-            height = track_height * data->channels;
+        AudioData *track = data;
+        int track_count = 0;
+        int decoded_count = 0;
+
+        // with -a, a track that can't be decoded is left out rather than failing the others
+        for (; track != NULL; track = track->next) {
+            if (is_empty_track(track)) {
+                fprintf(stderr, "Nothing could be decoded from audio stream %i, skipping it.\n",
+                        track->stream_index);
+            } else {
+                ++decoded_count;
+            }
+
+            ++track_count;
         }
 
-        // init the png struct so we can start drawing
-        WaveformPNG png = init_png(pOutFile, width, height);
+        if (decoded_count == 0) {
+            goto ERROR;
+        }
 
-        if (monofy) {
-            // if specified, call the drawing function that reduces all channels into a single
-            // waveform
-            draw_combined_waveform(&png, data);
-        } else {
-            // otherwise, draw them all stacked individually
-            draw_waveform(&png, data);
+        if (use_cache && data->summary == NULL) {
+            cache_audio_data(pFilePath, data, monofy);
         }
 
-        write_png(&png);
-        close_png(&png);
+        if (pOutFile && read_all_tracks && strstr(pOutFile, "%d")) {
+            // one image per track, numbered by stream index
+            const char *pIndex = strstr(pOutFile, "%d");
+
+            for (track = data; track != NULL; track = track->next) {
+                char pTrackFile[PATH_MAX];
+
+                if (is_empty_track(track)) {
+                    continue;
+                }
+
+                snprintf(pTrackFile, sizeof(pTrackFile), "%.*s%i%s",
+                         (int) (pIndex - pOutFile), pOutFile, track->stream_index, pIndex + 2);
+
+                if (render_tracks(track, 1, pTrackFile, width, height, track_height, monofy) != 0) {
+                    goto CANCELLED;
+                }
+            }
+        } else if (render_tracks(data, track_count, pOutFile, width, height, track_height, monofy) != 0) {
+            goto CANCELLED;
+        }
     }
 
     free_audio_data(data);
+    close_span_report();
+    report_progress("done", NULL);
     return 0;
 
 ERROR:
-    cleanup(pFormatContext, pDecoderContext);
+    free_audio_data(data);
+    close_span_report();
     return 1;
+
+CANCELLED:
+    fprintf(stderr, "Cancelled.\n");
+    report_progress("cancelled", NULL);
+
+    if (span_report) {
+        close_span_report();
+        unlink(pSpanReportFile);
+    }
+
+    if (data) {
+        free_audio_data(data);
+    }
+
+    return 2;
 }
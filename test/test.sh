@@ -18,9 +18,10 @@ result=
 #   Paremeter 1: the audio file to test
 #   Parameter 2: the image file to output
 #   Parameter 3: string of additional arguments to send to the waveform program
+#   Parameters 4+: arguments sent as they are, for paths that may contain spaces
 run () {
     # eval result=../waveform -i $1 -o $2 $3
-    ../waveform -i "$1" -o "$2" $3
+    ../waveform -i "$1" -o "$2" $3 "${@:4}"
 
     if [ $? -eq 0 ];
     then
@@ -57,11 +58,78 @@ done
 echo "testing color options..."
 run "$file" "$file.COLORTEST.png" "-h 800 -w 1600 -c 89d1f3ff -b 474b50ff"
 run "$file" "$file.COLOR_ALPHA_TEST.png" "-h 800 -w 1600 -c 000000ff -b 00000000"
+run "$file" "$file.BAND_COLORS.png" "-h 800 -w 1600 -B -b 000000ff"
+run "$file" "$file.BAND_COLORS_MONO.png" "-h 800 -w 1600 -m -B -b 000000ff"
 
 echo "testing metadata option..."
 # make sure if -d is there, everything else except -i is safely ignored
 ../waveform -i "$file" -m -d -h 800 -w 1600 -t 600 -c 000000ff -b ffffffff -m
 
+echo "testing stdin input..."
+if cat "$file" | ../waveform -i - -o "$file.STDIN.png" -h 800 -w 1600
+then
+    echo "'$file.STDIN.png'," >> images.js
+else
+    echo "'$file.STDIN.png.FAILED'," >> images.js
+fi
+
+echo "testing channel selection option..."
+run "$file" "$file.CHANNEL_SELECT.png" "-h 800 -w 1600 -C 1"
+run "$file" "$file.CHANNEL_MIX.png" "-h 800 -w 1600 -C L+R,0.5*L"
+
+echo "testing all tracks option..."
+run "$file" "$file.ALL_TRACKS.png" "-h 800 -w 1600 -a"
+
+echo "testing fast start option..."
+../waveform -i "$file" -d -f
+run "$file" "$file.FAST_START.png" "-h 800 -w 1600 -f"
+
+echo "testing spectrogram option..."
+run "$file" "$file.SPECTROGRAM.png" "-h 800 -w 1600 -S 2048"
+run "$file" "$file.SPECTROGRAM_HOP.png" "-h 800 -w 1600 -m -S 1024:256 -j 1"
+
+echo "testing auto gain options..."
+run "$file" "$file.GAIN_PEAK.png" "-h 800 -w 1600 -g peak"
+run "$file" "$file.GAIN_PERCENTILE_LOG.png" "-h 800 -w 1600 -m -g 99 -l"
+
+echo "testing threads option..."
+run "$file" "$file.THREADS_1.png" "-h 800 -w 1600 -B -j 1"
+run "$file" "$file.THREADS_8.png" "-h 800 -w 1600 -B -j 8"
+cmp "$file.THREADS_1.png" "$file.THREADS_8.png" || echo "-j 1 and -j 8 images differ"
+
+echo "testing cache option..."
+rm -rf "$file.cache"
+mkdir "$file.cache"
+run "$file" "$file.CACHE_MISS.png" "-h 800 -w 1600" -K "$file.cache:16"
+run "$file" "$file.CACHE_HIT.png" "-h 800 -w 1600" -K "$file.cache:16"
+cmp "$file.CACHE_MISS.png" "$file.CACHE_HIT.png" || echo "cached and decoded images differ"
+
+echo "testing playlist option..."
+../waveform -i "$file" -i "$file" -d
+run "$file" "$file.PLAYLIST.png" "-h 800 -w 1600" -i "$file"
+
+echo "testing silence and clipping report..."
+run "$file" "$file.SPANS.png" "-h 800 -w 1600 -s -50:1" -r "$file.spans.json"
+../waveform -i "$file" -d -r "$file.metadata.spans.json"
+
+# one second of digital silence as unsigned 8 bit samples (128), which never normalizes to
+# exactly 0
+u8_dir=$(mktemp -d)
+printf 'RIFF\x64\x1f\x00\x00WAVEfmt \x10\x00\x00\x00\x01\x00\x01\x00\x40\x1f\x00\x00\x40\x1f\x00\x00\x01\x00\x08\x00data\x40\x1f\x00\x00' > "$u8_dir/silence.wav"
+head -c 8000 /dev/zero | tr '\0' '\200' >> "$u8_dir/silence.wav"
+../waveform -i "$u8_dir/silence.wav" -d -r "$u8_dir/spans.json" -s -90:0.5 > /dev/null
+grep -q '"silence":\[{' "$u8_dir/spans.json" || echo "silence in unsigned 8 bit audio wasn't found"
+rm -rf "$u8_dir"
+
+echo "testing progress and deadline options..."
+run "$file" "$file.PROGRESS.png" "-h 800 -w 1600 -p 2"
+# stdin that stays open without sending anything, so the deadline always passes first
+rm -f "$file.DEADLINE.png"
+sleep 5 | ../waveform -i - -o "$file.DEADLINE.png" -h 800 -w 1600 -T 1
+status=$?
+[ $status -eq 2 ] || echo "-T should exit with 2 once the deadline passes, not $status"
+[ ! -e "$file.DEADLINE.png" ] || echo "-T left $file.DEADLINE.png behind"
+
 # generate different sizes of thumbnails to show how the waveform changes
 # with the quantization resolution
 if [ ! -z $file ]